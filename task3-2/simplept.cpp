@@ -3,11 +3,170 @@
 #include <cmath>
 #include <random>
 #include <vector>
-#include <omp.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <list>
+#include <unordered_map>
 #define PI 3.1415926535897932384626433832795
 
 //Path-tracing Version 1.1 with "fixed" Specular Surface calculations (Task 3-2 of Part 2 of Project 2)
 
+/*
+* Task runtime: a small work-stealing scheduler with fork/join and task
+* dependencies. Rendering tiles and post-processing run as tasks on the same
+* workers, so stages overlap instead of meeting at a barrier.
+*/
+
+struct Task;
+typedef std::shared_ptr<Task> TaskRef;
+
+struct Task {
+	std::function<void()> fn;
+	std::atomic<int> unmet{1};          // unfinished dependencies, +1 held until spawn() returns
+	std::atomic<bool> done{false};
+	std::mutex lock;                    // guards done/successors hand-over
+	std::vector<TaskRef> successors;
+};
+
+struct TaskScheduler {
+	// the calling thread becomes worker 0 and takes part in wait()
+	void init(int nworkers) {
+		n = nworkers;
+		stopping = false;
+		queues.reset(new Queue[n]);
+		workerIndex = 0;
+		for (int i = 1; i < n; i++) threads.emplace_back(&TaskScheduler::workerLoop, this, i);
+	}
+
+	void shutdown() {
+		stopping = true;
+		{ std::lock_guard<std::mutex> g(sleepLock); wakeup.notify_all(); }
+		for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+		threads.clear();
+	}
+
+	static int workerId() { return workerIndex; }
+	int numWorkers() const { return n; }
+
+	// runs fn once every task in deps has finished
+	TaskRef spawn(std::function<void()> fn, const std::vector<TaskRef> &deps = std::vector<TaskRef>()) {
+		TaskRef t = std::make_shared<Task>();
+		t->fn = std::move(fn);
+		for (size_t i = 0; i < deps.size(); i++) {
+			if (!deps[i]) continue;
+			std::lock_guard<std::mutex> g(deps[i]->lock);
+			if (deps[i]->done) continue;
+			t->unmet++;
+			deps[i]->successors.push_back(t);
+		}
+		if (--t->unmet == 0) enqueue(t);
+		return t;
+	}
+
+	// helps executing tasks until t has finished
+	void wait(const TaskRef &t) {
+		while (!t->done) {
+			if (!runOne()) std::this_thread::yield();
+		}
+	}
+
+	void waitAll(const std::vector<TaskRef> &ts) {
+		for (size_t i = 0; i < ts.size(); i++) if (ts[i]) wait(ts[i]);
+	}
+
+	// fork/join over [begin, end): halves are split recursively so nested calls
+	// from inside tasks keep every worker busy
+	void parallelFor(int begin, int end, int grain, const std::function<void(int, int)> &body) {
+		if (end - begin <= grain) {
+			if (begin < end) body(begin, end);
+			return;
+		}
+		int mid = begin + (end - begin) / 2;
+		TaskRef right = spawn([=, &body]() { parallelFor(mid, end, grain, body); });
+		parallelFor(begin, mid, grain, body);
+		wait(right);
+	}
+
+private:
+	struct Queue {
+		std::mutex lock;
+		std::deque<TaskRef> tasks;          // owner works at the back, thieves take the front
+	};
+
+	void enqueue(const TaskRef &t) {
+		Queue &q = queues[workerIndex >= 0 && workerIndex < n ? workerIndex : 0];
+		{ std::lock_guard<std::mutex> g(q.lock); q.tasks.push_back(t); }
+		queued++;
+		if (sleepers.load()) { std::lock_guard<std::mutex> g(sleepLock); wakeup.notify_one(); }
+	}
+
+	bool runOne() {
+		int self = workerIndex >= 0 && workerIndex < n ? workerIndex : 0;
+		TaskRef t;
+		for (int k = 0; k < n && !t; k++) {
+			Queue &q = queues[(self + k) % n];
+			std::lock_guard<std::mutex> g(q.lock);
+			if (q.tasks.empty()) continue;
+			if (k == 0) { t = q.tasks.back(); q.tasks.pop_back(); }
+			else { t = q.tasks.front(); q.tasks.pop_front(); }
+		}
+		if (!t) return false;
+		queued--;
+		execute(t);
+		return true;
+	}
+
+	void execute(const TaskRef &t) {
+		t->fn();
+		t->fn = nullptr;
+		std::vector<TaskRef> next;
+		{
+			std::lock_guard<std::mutex> g(t->lock);
+			t->done = true;
+			next.swap(t->successors);
+		}
+		for (size_t i = 0; i < next.size(); i++)
+			if (--next[i]->unmet == 0) enqueue(next[i]);
+	}
+
+	void workerLoop(int id) {
+		workerIndex = id;
+		while (!stopping) {
+			if (runOne()) continue;
+			std::unique_lock<std::mutex> g(sleepLock);
+			sleepers++;
+			wakeup.wait_for(g, std::chrono::milliseconds(2), [this]() { return queued.load() > 0 || stopping.load(); });
+			sleepers--;
+		}
+	}
+
+	int n = 1;
+	std::unique_ptr<Queue[]> queues;
+	std::vector<std::thread> threads;
+	std::atomic<int> queued{0}, sleepers{0};
+	std::atomic<bool> stopping{false};
+	std::mutex sleepLock;
+	std::condition_variable wakeup;
+	static thread_local int workerIndex;
+} scheduler;
+
+thread_local int TaskScheduler::workerIndex = -1;
+
+
 /*
 * Thread-safe random number generator
 */
@@ -18,6 +177,7 @@ struct RNG {
 
 	void init(int nworkers) {
 		engines.resize(nworkers);
+		prefixes.assign(nworkers, Prefix());
 #if 0
 		std::random_device rd;
 		for (int i = 0; i < nworkers; ++i)
@@ -30,16 +190,253 @@ struct RNG {
 #endif
 	}
 
+	// restarts the calling worker's stream from a seed derived from (a, b) only
+	void reseed(std::uint32_t a, std::uint32_t b) {
+		std::seed_seq seq{ 1234u, a, b };
+		engines[TaskScheduler::workerId()].seed(seq);
+	}
+
+	// the calling worker's next n (<= 8) draws return values, then the engine resumes
+	void setPrefix(const double *values, int n) {
+		Prefix &p = prefixes[TaskScheduler::workerId()];
+		std::copy(values, values + n, p.values);
+		p.next = 0;
+		p.count = n;
+	}
+
 	double operator()() {
-		int id = omp_get_thread_num();
+		int id = TaskScheduler::workerId();
+		Prefix &p = prefixes[id];
+		if (p.next < p.count) return p.values[p.next++];
 		return distrb(engines[id]);
 	}
 
+	struct alignas(64) Prefix {
+		double values[8];
+		int next = 0, count = 0;
+	};
+
 	std::uniform_real_distribution<double> distrb;
 	std::vector<std::mt19937> engines;
+	std::vector<Prefix> prefixes;
 } rng;
 
 
+/*
+* Blue-noise sampling: the first dimensions of each camera path follow a
+* per-pixel additive recurrence (Kronecker) sequence, Cranley-Patterson
+* rotated by a 64x64 void-and-cluster blue-noise tile shifted per dimension.
+* Neighbouring pixels get evenly spread, decorrelated offsets, so at low spp
+* the screen-space error is blue rather than white noise.
+*/
+
+struct BlueNoise {
+	enum { Size = 64, Dims = 8 };
+
+	// void-and-cluster (Ulichney 1993) with a toroidal Gaussian energy kernel
+	void generate() {
+		const int N = Size * Size;
+		const double sigma = 1.5;
+		std::vector<double> kernel(N), energy(N, 0.0);
+		std::vector<char> on(N, 0);
+		std::vector<int> rank(N);
+		for (int y = 0; y < Size; y++) {
+			for (int x = 0; x < Size; x++) {
+				int dx = std::min(x, Size - x), dy = std::min(y, Size - y);
+				kernel[y*Size + x] = exp(-(dx*dx + dy*dy) / (2 * sigma*sigma));
+			}
+		}
+		auto toggle = [&](int p) {
+			const int px = p % Size, py = p / Size;
+			const double sign = on[p] ? -1.0 : 1.0;
+			on[p] ^= 1;
+			for (int q = 0; q < N; q++)
+				energy[q] += sign * kernel[((q / Size - py + Size) % Size) * Size + (q % Size - px + Size) % Size];
+		};
+		// tightest cluster (densest 1) or largest void (emptiest 0)
+		auto extreme = [&](bool cluster) {
+			int best = -1;
+			for (int q = 0; q < N; q++)
+				if (on[q] == cluster && (best < 0 || (cluster ? energy[q] > energy[best] : energy[q] < energy[best])))
+					best = q;
+			return best;
+		};
+
+		std::mt19937 gen(1234);
+		for (int k = 0; k < N / 10; k++) {
+			int p = gen() % N;
+			if (!on[p]) toggle(p);
+		}
+		for (int iter = 0; iter < N; iter++) {
+			int c = extreme(true);
+			toggle(c);
+			int v = extreme(false);
+			toggle(v);
+			if (v == c) break;
+		}
+
+		const std::vector<char> initialOn = on;
+		const std::vector<double> initialEnergy = energy;
+		int ones = 0;
+		for (int q = 0; q < N; q++) ones += on[q];
+		for (int r = ones - 1; r >= 0; r--) {
+			int c = extreme(true);
+			rank[c] = r;
+			toggle(c);
+		}
+		on = initialOn;
+		energy = initialEnergy;
+		for (int r = ones; r < N; r++) {
+			int v = extreme(false);
+			rank[v] = r;
+			toggle(v);
+		}
+
+		tile.resize(N);
+		for (int q = 0; q < N; q++) tile[q] = (rank[q] + 0.5f) / N;
+
+		// R_d generalized golden ratio increments (Roberts 2018)
+		double phi = 2.0;
+		for (int k = 0; k < 32; k++) phi = pow(1 + phi, 1.0 / (Dims + 1));
+		for (int d = 0; d < Dims; d++) alpha[d] = fmod(pow(1.0 / phi, d + 1), 1.0);
+	}
+
+	// dimension dim of the index-th sample of pixel (x, y)
+	double value(int x, int y, int dim, int index) const {
+		const int ox = (dim * 23) % Size, oy = (dim * 41) % Size;
+		double v = tile[((y + oy) % Size) * Size + (x + ox) % Size] + index * alpha[dim];
+		return v - floor(v);
+	}
+
+	bool enabled = false;
+	std::vector<float> tile;
+	double alpha[Dims];
+} blueNoise;
+
+
+/*
+* Render settings: throughput knobs that --calibrate tunes per machine and scene
+*/
+
+struct RenderSettings {
+	int threads = 0;                    // worker threads, 0 = one per hardware thread
+	int tile = 32;                      // tile edge in pixels
+	int sampsPerPass = 0;               // samples per subpixel and pass, 0 = automatic
+	int rrDepth = 5;                    // Russian roulette starts after this depth
+	float survivalProbability = 0.9f;   // Russian roulette survival probability
+	int lightSplit = 1;                 // light samples at the primary hit
+	int brdfSplit = 1;                  // BRDF samples at the primary hit
+	bool splitSecondary = false;        // split at the second diffuse vertex too
+
+	bool load(const char *path) {
+		FILE *f = fopen(path, "r");
+		if (!f) return false;
+		char key[64];
+		double value;
+		while (fscanf(f, "%63s %lf", key, &value) == 2) {
+			if (!strcmp(key, "threads")) threads = int(value);
+			else if (!strcmp(key, "tile")) tile = int(value);
+			else if (!strcmp(key, "spp_per_pass")) sampsPerPass = int(value);
+			else if (!strcmp(key, "rr_depth")) rrDepth = int(value);
+			else if (!strcmp(key, "survival")) survivalProbability = float(value);
+			else if (!strcmp(key, "light_split")) lightSplit = int(value);
+			else if (!strcmp(key, "brdf_split")) brdfSplit = int(value);
+			else if (!strcmp(key, "split_secondary")) splitSecondary = value != 0;
+		}
+		fclose(f);
+		return true;
+	}
+
+	bool save(const char *path) const {
+		FILE *f = fopen(path, "w");
+		if (!f) return false;
+		fprintf(f, "threads %d\ntile %d\nspp_per_pass %d\nrr_depth %d\nsurvival %g\n"
+			"light_split %d\nbrdf_split %d\nsplit_secondary %d\n",
+			threads, tile, sampsPerPass, rrDepth, survivalProbability, lightSplit, brdfSplit, int(splitSecondary));
+		fclose(f);
+		return true;
+	}
+} settings;
+
+/*
+* Render statistics and control (shared with the metrics socket)
+*/
+
+struct alignas(64) ThreadStats {
+	std::atomic<long long> rays{0};     // rays traced by this thread (single writer)
+	std::atomic<double> busy{0.0};      // seconds spent rendering tiles
+	std::atomic<long long> shadowRays{0}, shadowCacheHits{0}, shadowFarSide{0}, shadowBlocked{0};
+
+	void addRay() { rays.store(rays.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+	static void add(std::atomic<long long> &counter) { counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+};
+
+struct RenderControl {
+	typedef std::chrono::steady_clock Clock;
+
+	void init(int nworkers) {
+		nthreads = nworkers;
+		threads.reset(new ThreadStats[nworkers]);
+		start = Clock::now();
+		tilesDone = 0;
+		passesDone = 0;
+	}
+
+	double elapsed() const {
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	// wall time spent rendering, i.e. excluding time spent paused
+	double renderTime() const {
+		std::lock_guard<std::mutex> g(pauseLock);
+		double t = elapsed() - pausedTotal;
+		if (paused.load()) t -= std::chrono::duration<double>(Clock::now() - pauseStart).count();
+		return t;
+	}
+
+	double progress() const {
+		long long total = (long long)totalTiles * totalPasses;
+		return total > 0 ? double(tilesDone.load()) / total : 0.0;
+	}
+
+	// true once workers should stop picking up new tiles
+	bool halted() const {
+		double b = budget.load();
+		return stopRequested.load() || (b > 0 && renderTime() > b);
+	}
+
+	void pause() {
+		std::lock_guard<std::mutex> g(pauseLock);
+		if (!paused.exchange(true)) pauseStart = Clock::now();
+	}
+
+	void resume() {
+		std::lock_guard<std::mutex> g(pauseLock);
+		if (paused.load()) {
+			pausedTotal += std::chrono::duration<double>(Clock::now() - pauseStart).count();
+			paused = false;
+		}
+	}
+
+	void waitIfPaused() const {
+		while (paused.load() && !stopRequested.load())
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+
+	int nthreads = 0;
+	std::unique_ptr<ThreadStats[]> threads;
+	Clock::time_point start;
+	Clock::time_point pauseStart;               // guarded by pauseLock, as is pausedTotal
+	double pausedTotal = 0.0;
+	mutable std::mutex pauseLock;
+	std::atomic<double> budget{0.0};            // seconds of render time, 0 = unlimited
+	std::atomic<bool> paused{false}, stopRequested{false}, finished{false};
+	std::atomic<int> tilesDone{0}, passesDone{0};
+	std::atomic<int> totalTiles{0}, totalPasses{0}, sampsPerPass{0}, samps{0};    // read by the socket thread
+	bool quiet = false;                         // no progress line on stderr (calibration probes)
+} control;
+
+
 /*
 * Basic data types
 */
@@ -61,13 +458,18 @@ struct Vec {
 
 struct Ray {
 	Vec o, d;
-	Ray(Vec o_, Vec d_) : o(o_), d(d_) {}
+	double time;        // in [0, 1) over the shutter interval
+	Ray(Vec o_ = Vec(), Vec d_ = Vec(), double time_ = 0) : o(o_), d(d_), time(time_) {}
 };
 
 struct BRDF {
 	virtual Vec eval(const Vec &n, const Vec &o, const Vec &i) const = 0;
 	virtual void sample(const Vec &n, const Vec &o, Vec &i, double &pdf) const = 0;
 	virtual bool isSpecular() const = 0;
+	virtual Vec albedo() const = 0;     // directional-hemispherical reflectance, for previews
+	virtual void setAlbedo(const Vec &a) = 0;     // material edits
+
+	int material = 63;                  // bit in the per-pixel material masks (63 collects the rest)
 };
 
 
@@ -79,6 +481,10 @@ inline double clamp(double x) {
 	return x < 0 ? 0 : x > 1 ? 1 : x;
 }
 
+inline Vec clamp(const Vec &r) {
+	return Vec(clamp(r.x), clamp(r.y), clamp(r.z));
+}
+
 inline int toInt(double x) {
 	return static_cast<int>(std::pow(clamp(x), 1.0 / 2.2) * 255 + .5);
 }
@@ -89,15 +495,22 @@ inline int toInt(double x) {
 */
 
 struct Sphere {
-	Vec p, e;           // position, emitted radiance
+	Vec p, e;           // position (at shutter open), emitted radiance
+	Vec v;              // linear motion of the center over the shutter interval
 	double rad;         // radius
+	double invRad;      // 1 / radius, turns x - center into the unit normal
 	const BRDF &brdf;   // BRDF
 
-	Sphere(double rad_, Vec p_, Vec e_, const BRDF &brdf_) :
-		rad(rad_), p(p_), e(e_), brdf(brdf_) {}
+	Sphere(double rad_, Vec p_, Vec e_, const BRDF &brdf_, Vec v_ = Vec()) :
+		rad(rad_), invRad(1 / rad_), p(p_), e(e_), v(v_), brdf(brdf_) {}
+
+	Vec center(double time) const { return p + v * time; }
 
-	double intersect(const Ray &r) const { // returns distance, 0 if nohit
-		Vec op = p - r.o; // Solve t^2*d.d + 2*t*(o-p).d + (o-p).(o-p)-R^2 = 0
+	double intersect(const Ray &r) const { return intersect(r, center(r.time)); }
+
+	// against the sphere centred at c, for callers that know it does not move
+	double intersect(const Ray &r, const Vec &c) const { // returns distance, 0 if nohit
+		Vec op = c - r.o; // Solve t^2*d.d + 2*t*(o-p).d + (o-p).(o-p)-R^2 = 0
 		double t, eps = 1e-4, b = op.dot(r.d), det = b*b - op.dot(op) + rad*rad;
 		if (det<0) return 0; else det = sqrt(det);
 		return (t = b - det)>eps ? t : ((t = b + det)>eps ? t : 0);
@@ -106,380 +519,4379 @@ struct Sphere {
 
 
 /*
-* Sampling functions
+* Triangle meshes with an SBVH (Stich et al. 2009): binned SAH object splits,
+* plus spatial splits that clip triangles into bins where that lowers the SAH
+* cost. Spatial splits are only tried where the object split's children
+* overlap noticeably, and stop once a budget of duplicated references is used.
 */
 
-inline void createLocalCoord(const Vec &n, Vec &u, Vec &v, Vec &w) {
-	w = n;
-	u = ((std::abs(w.x)>.1 ? Vec(0, 1) : Vec(1)).cross(w)).normalize();
-	v = w.cross(u);
-}
+inline double axis(const Vec &v, int a) { return a == 0 ? v.x : a == 1 ? v.y : v.z; }
+inline void setAxis(Vec &v, int a, double value) { (a == 0 ? v.x : a == 1 ? v.y : v.z) = value; }
 
+struct AABB {
+	AABB() : lo(1e30, 1e30, 1e30), hi(-1e30, -1e30, -1e30) {}
 
-/*
-* BRDFs   (each had it's own structure)
-*/
+	bool valid() const { return lo.x <= hi.x && lo.y <= hi.y && lo.z <= hi.z; }
 
-// Ideal diffuse BRDF
-struct DiffuseBRDF : public BRDF {
-	DiffuseBRDF(Vec kd_) : kd(kd_) {}
+	void grow(const Vec &p) {
+		lo = Vec(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+		hi = Vec(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+	}
 
-	Vec eval(const Vec &n, const Vec &o, const Vec &i) const {
-		return kd * (1.0 / PI);
+	void grow(const AABB &b) {
+		if (b.valid()) { grow(b.lo); grow(b.hi); }
 	}
 
-	void sample(const Vec &n, const Vec &o, Vec &i, double &pdf) const {		//SAMPLE IMPLEMENTATION
-		float z, r, x, y, phi;
-		z = sqrt(rng());
-		r = sqrt(1.0 - (z * z));
-		phi = 2.0 * PI * rng();
-		x = r * cos(phi);
-		y = r * sin(phi);
-		Vec u1, v1, w1;
-		createLocalCoord(n, u1, v1, w1);
-		i = u1*x + v1*y + w1*z;
-		pdf = i.dot(n) / PI;
+	AABB overlap(const AABB &b) const {
+		AABB o;
+		o.lo = Vec(std::max(lo.x, b.lo.x), std::max(lo.y, b.lo.y), std::max(lo.z, b.lo.z));
+		o.hi = Vec(std::min(hi.x, b.hi.x), std::min(hi.y, b.hi.y), std::min(hi.z, b.hi.z));
+		return o;
 	}
 
-	bool isSpecular() const {
-		return false;
+	double area() const {
+		if (!valid()) return 0;
+		Vec d = hi - lo;
+		return 2 * (d.x*d.y + d.y*d.z + d.z*d.x);
 	}
 
-	Vec kd;
+	Vec center() const { return (lo + hi) * 0.5; }
+
+	AABB lerp(const AABB &b, double t) const {
+		AABB o;
+		o.lo = lo + (b.lo - lo) * t;
+		o.hi = hi + (b.hi - hi) * t;
+		return o;
+	}
+
+	// slab test against [0, tmax); invD holds 1 / r.d per axis
+	bool hit(const Ray &r, const Vec &invD, double tmax) const {
+		double t0 = 0, t1 = tmax;
+		for (int a = 0; a < 3; a++) {
+			double ta = (axis(lo, a) - axis(r.o, a)) * axis(invD, a), tb = (axis(hi, a) - axis(r.o, a)) * axis(invD, a);
+			if (ta > tb) std::swap(ta, tb);
+			t0 = ta > t0 ? ta : t0;
+			t1 = tb < t1 ? tb : t1;
+			if (t0 > t1) return false;
+		}
+		return true;
+	}
+
+	Vec lo, hi;
 };
 
-//Ideal specular BRDF
-struct SpecularBRDF : public BRDF {
-	SpecularBRDF(Vec ks_) : ks(ks_) {}
+// two rays of a packet in one SSE2 register; wider vectors than the target
+// has are split up lane by lane and run slower than scalar code
+typedef double Lanes __attribute__((vector_size(16)));
+typedef decltype(Lanes() < Lanes()) LaneMask;      // comparison results, all ones where true
 
-	Vec eval(const Vec &n, const Vec &o, const Vec &i) const {
-		Vec tempVec = mirroredDirection(n, o);
-		double diffX, diffY, diffZ;
-		double epsil = 1e-5;		///Varying Epsilon
-		diffX = abs(double(i.x) - double(tempVec.x));
-		diffY = abs(double(i.y) - double(tempVec.y));
-		diffZ = abs(double(i.z) - double(tempVec.z));
+inline unsigned laneBits(const LaneMask &m) { return unsigned((m[0] & 1) | (m[1] & 2)); }
 
-		if (((diffX < epsil) && (diffY < epsil)) && (diffZ < epsil)) {
-			return ks * (1.0 / n.dot(i));
+// Up to Size segments traced together for an any-hit query, e.g. shadow rays
+// towards one light. The rays are also kept by axis, Width to a vector, so a
+// box, sphere or triangle is tested against Width rays at once with the same
+// arithmetic as the scalar tests. A node missing the bounds of all segments is
+// rejected for the whole packet.
+struct RayPacket {
+	enum { Size = 16, Width = 2, Groups = Size / Width };
+
+	void add(const Ray &r, double t) {
+		const int g = count / Width, l = count % Width;
+		rays[count++] = r;
+		for (int a = 0; a < 3; a++) {
+			o[a][g][l] = axis(r.o, a);
+			d[a][g][l] = axis(r.d, a);
 		}
-		else {
-			return 0.0;
+		tmax[g][l] = t;
+		time[g][l] = r.time;
+	}
+
+	double limit(int k) const { return tmax[k / Width][k % Width]; }
+
+	// the Width bits of group g in a mask over the packet
+	static unsigned group(unsigned bits, int g) { return bits >> (g * Width) & ((1u << Width) - 1); }
+
+	void finalize() {
+		// unused lanes get an empty segment, so they miss everything
+		for (int k = count; k < Size; k++) {
+			const int g = k / Width, l = k % Width;
+			for (int a = 0; a < 3; a++) { o[a][g][l] = 0; d[a][g][l] = 1; }
+			tmax[g][l] = -1;
+			time[g][l] = 0;
+		}
+		for (int g = 0; g < Groups; g++)
+			for (int a = 0; a < 3; a++) invD[a][g] = 1.0 / d[a][g];
+		bounds = AABB();
+		timeLo = 1; timeHi = 0;
+		for (int k = 0; k < count; k++) {
+			const Ray &r = rays[k];
+			bounds.grow(r.o);
+			bounds.grow(r.o + r.d * limit(k));
+			timeLo = std::min(timeLo, r.time); timeHi = std::max(timeHi, r.time);
 		}
+	}
+
+	// true if no ray of the packet can hit box within its tmax
+	bool culls(const AABB &box) const { return !box.overlap(bounds).valid(); }
 
+	// AABB::hit for the rays of group g, a bit per ray entering box
+	unsigned hits(const AABB &box, int g) const {
+		double lo[3] = { box.lo.x, box.lo.y, box.lo.z }, hi[3] = { box.hi.x, box.hi.y, box.hi.z };
+		return slab(lo, hi, g);
 	}
 
-	void sample(const Vec &n, const Vec &o, Vec &i, double &pdf) const {		//SAMPLE IMPLEMENTATION
-		Vec wi = mirroredDirection(n, o);
-		pdf = 1.0;
-		i = wi;
+	// the same against a box moving from a at time0 to b at time1, each ray at its own time
+	unsigned hits(const AABB &a, const AABB &b, double time0, double time1, int g) const {
+		Lanes s = (time[g] - time0) / (time1 - time0), lo[3], hi[3];
+		for (int k = 0; k < 3; k++) {
+			lo[k] = axis(a.lo, k) + (axis(b.lo, k) - axis(a.lo, k)) * s;
+			hi[k] = axis(a.hi, k) + (axis(b.hi, k) - axis(a.hi, k)) * s;
+		}
+		return slab(lo, hi, g);
 	}
 
-	Vec mirroredDirection(const Vec &n, const Vec &o) const {
-		Vec temp = Vec();
-		temp = (((n * 2.0) * n.dot(o)) - o);
-		return temp;
+	// Sphere::intersect() for the rays of group g, a bit per ray it blocks short of tmax
+	unsigned blockedBy(const Sphere &s, int g) const {
+		Lanes op[3];
+		const bool moving = s.v.x || s.v.y || s.v.z;
+		for (int a = 0; a < 3; a++)
+			op[a] = (moving ? axis(s.p, a) + axis(s.v, a) * time[g] : axis(s.p, a) - Lanes()) - o[a][g];
+		Lanes b = op[0] * d[0][g] + op[1] * d[1][g] + op[2] * d[2][g];
+		Lanes det = b*b - (op[0] * op[0] + op[1] * op[1] + op[2] * op[2]) + s.rad*s.rad;
+		LaneMask reached = det >= 0;
+		if (!laneBits(reached)) return 0;
+		Lanes root = reached ? det : Lanes();
+		for (int l = 0; l < Width; l++) root[l] = sqrt(root[l]);     // no vector square root in GCC's extensions
+		const double eps = 1e-4;
+		Lanes near = b - root, far = b + root;
+		Lanes t = near > eps ? near : (far > eps ? far : Lanes());
+		return laneBits(reached & (t != 0) & (t < tmax[g]));
 	}
 
-	bool isSpecular() const {
-		return true;
+	// intersectTriangle() for the rays of group g, a bit per ray the triangle blocks short of tmax
+	unsigned blockedBy(const Vec &v0, const Vec &v1, const Vec &v2, int g) const {
+		Vec e1 = v1 - v0, e2 = v2 - v0;
+		Lanes pv[3] = { d[1][g] * e2.z - d[2][g] * e2.y, d[2][g] * e2.x - d[0][g] * e2.z, d[0][g] * e2.y - d[1][g] * e2.x };
+		Lanes det = e1.x * pv[0] + e1.y * pv[1] + e1.z * pv[2];
+		Lanes inv = 1.0 / det;
+		Lanes tv[3] = { o[0][g] - v0.x, o[1][g] - v0.y, o[2][g] - v0.z };
+		Lanes u = (tv[0] * pv[0] + tv[1] * pv[1] + tv[2] * pv[2]) * inv;
+		Lanes qv[3] = { tv[1] * e1.z - tv[2] * e1.y, tv[2] * e1.x - tv[0] * e1.z, tv[0] * e1.y - tv[1] * e1.x };
+		Lanes v = (d[0][g] * qv[0] + d[1][g] * qv[1] + d[2][g] * qv[2]) * inv;
+		Lanes t = (e2.x * qv[0] + e2.y * qv[1] + e2.z * qv[2]) * inv;
+		LaneMask parallel = (det < 1e-12) & (det > -1e-12), outside = (u < 0) | (u > 1) | (v < 0) | (u + v > 1);
+		return laneBits(~(parallel | outside) & (t > 1e-4) & (t < tmax[g]));
 	}
 
-	Vec ks;
-};
+	Ray rays[Size];
+	Lanes o[3][Groups], d[3][Groups], invD[3][Groups], tmax[Groups], time[Groups];    // rays[] by axis
+	int count = 0;
+	AABB bounds;                // of all segments
+	double timeLo, timeHi;
 
+private:
+	// the slab test of AABB::hit(); Bound is double for a fixed box or Lanes for one per ray
+	template <typename Bound>
+	unsigned slab(const Bound *lo, const Bound *hi, int g) const {
+		Lanes t0 = {}, t1 = tmax[g];
+		for (int a = 0; a < 3; a++) {
+			Lanes ta = (lo[a] - o[a][g]) * invD[a][g], tb = (hi[a] - o[a][g]) * invD[a][g];
+			Lanes tn = ta > tb ? tb : ta, tf = ta > tb ? ta : tb;
+			t0 = tn > t0 ? tn : t0;
+			t1 = tf < t1 ? tf : t1;
+		}
+		// t0 only grows and t1 only shrinks, so checking once at the end is AABB::hit()'s early out
+		return laneBits(t0 <= t1);
+	}
+};
 
-/*
-* Scene configuration
-*/
+// flattened depth-first: an interior node's first child directly follows it,
+// so children always have larger indices than their parent
+struct BVHNode {
+	AABB box;
+	int start, count;       // leaf: range of BVH::prims; count == 0 marks an interior node
+	int second, splitAxis;  // interior: index of the second child, axis of the split
+};
 
-// Pre-defined BRDFs
-const DiffuseBRDF leftWall(Vec(.75, .25, .25)),
-rightWall(Vec(.25, .25, .75)),
-otherWall(Vec(.75, .75, .75)),
-blackSurf(Vec(0.0, 0.0, 0.0)),
-brightSurf(Vec(0.9, 0.9, 0.9));
+struct BVH {
+	// visits the leaves hit by r front to back; leaf(start, count, tmax) returns
+	// true on a hit closer than tmax and then shrinks tmax
+	template <typename Leaf>
+	bool traverse(const Ray &r, double &tmax, Leaf leaf) const {
+		if (nodes.empty()) return false;
+		Vec invD(1.0 / r.d.x, 1.0 / r.d.y, 1.0 / r.d.z);
+		int stack[64], top = 0, cur = 0;
+		bool hit = false;
+		for (;;) {
+			const BVHNode &node = nodes[cur];
+			bool entered = endBoxes.empty() ? node.box.hit(r, invD, tmax) :
+				node.box.lerp(endBoxes[cur], (r.time - time0) / (time1 - time0)).hit(r, invD, tmax);
+			if (entered) {
+				if (node.count) {
+					hit |= leaf(node.start, node.count, tmax);
+				}
+				else {
+					bool backFirst = axis(r.d, node.splitAxis) < 0;
+					stack[top++] = backFirst ? cur + 1 : node.second;
+					cur = backFirst ? node.second : cur + 1;
+					continue;
+				}
+			}
+			if (!top) break;
+			cur = stack[--top];
+		}
+		return hit;
+	}
 
-//Pre-defined Specular BRDF
-const SpecularBRDF specBRDF(Vec(0.999, 0.999, 0.999));
+	// any-hit traversal of a packet; live has a bit per ray still unblocked and
+	// leaf(start, count, active, live) clears the bits of the active rays (those
+	// reaching the leaf) it finds blocked. Returns the node visits and how many
+	// of them the packet's shared test rejected.
+	template <typename Leaf>
+	std::pair<int, int> traversePacket(const RayPacket &p, unsigned &live, Leaf leaf) const {
+		int visits = 0, culled = 0;
+		if (nodes.empty()) return std::make_pair(visits, culled);
+		int stack[64], top = 0, cur = 0;
+		unsigned masks[64], mask = live;     // rays that reached the node's parent
+		for (;;) {
+			const BVHNode &node = nodes[cur];
+			mask &= live;
+			AABB box = node.box;
+			if (!endBoxes.empty()) {
+				// the box moves linearly, so the ends of the packet's time range bound it
+				double s0 = (p.timeLo - time0) / (time1 - time0), s1 = (p.timeHi - time0) / (time1 - time0);
+				box = node.box.lerp(endBoxes[cur], s0);
+				box.grow(node.box.lerp(endBoxes[cur], s1));
+			}
+			visits++;
+			unsigned active = 0;
+			// the shared test only pays off while several rays are left
+			if (__builtin_popcount(mask) >= 4 && p.culls(box)) culled++;
+			else {
+				// the first group entering the node takes all later rays along
+				// untested, as their own leaf tests still decide; coherent rays
+				// mostly cost one box test per node that way
+				for (int g = 0; g < RayPacket::Groups; g++) {
+					unsigned lanes = RayPacket::group(mask, g);
+					if (!lanes) continue;
+					lanes &= endBoxes.empty() ? p.hits(box, g) : p.hits(node.box, endBoxes[cur], time0, time1, g);
+					if (!lanes) continue;
+					active = lanes << (g * RayPacket::Width) | (mask & ~0u << (g + 1) * RayPacket::Width);
+					break;
+				}
+			}
+			if (active) {
+				if (node.count) {
+					leaf(node.start, node.count, active, live);
+					if (!live) break;
+				}
+				else {
+					// near child first along the packet's direction, as in traverse()
+					bool backFirst = axis(p.rays[__builtin_ctz(active)].d, node.splitAxis) < 0;
+					masks[top] = active;
+					stack[top++] = backFirst ? cur + 1 : node.second;
+					cur = backFirst ? node.second : cur + 1;
+					mask = active;
+					continue;
+				}
+			}
+			if (!top) break;
+			cur = stack[--top];
+			mask = masks[top];
+		}
+		return std::make_pair(visits, culled);
+	}
 
-// Scene: list of spheres
-const Sphere spheres[] = {
-	Sphere(1e5,  Vec(1e5 + 1,40.8,81.6),   Vec(),         leftWall),   // Left
-	Sphere(1e5,  Vec(-1e5 + 99,40.8,81.6), Vec(),         rightWall),  // Right
-	Sphere(1e5,  Vec(50,40.8, 1e5),      Vec(),         otherWall),  // Back
-	Sphere(1e5,  Vec(50, 1e5, 81.6),     Vec(),         otherWall),  // Bottom
-	Sphere(1e5,  Vec(50,-1e5 + 81.6,81.6), Vec(),         otherWall),  // Top
-	Sphere(16.5, Vec(27,16.5,47),        Vec(),         brightSurf), // Ball 1
-	Sphere(16.5, Vec(73,16.5,78),        Vec(),         specBRDF), // Ball 2
-	Sphere(5.0,  Vec(50,70.0,81.6),      Vec(50,50,50), blackSurf)   // Light
+	std::vector<BVHNode> nodes;
+	std::vector<int> prims;                 // leaf primitive lists (spatial splits may repeat a triangle)
+	std::vector<AABB> endBoxes;             // for moving primitives: node bounds at time1, nodes[].box at time0
+	double time0 = 0, time1 = 1;
 };
 
-// Camera position & direction
-const Ray cam(Vec(50, 52, 295.6), Vec(0, -0.042612, -1).normalize());
+struct SBVHBuilder {
+	struct Ref {
+		int tri;
+		AABB box;
+	};
 
+	struct BuildNode {
+		AABB box;
+		int splitAxis = 0;
+		std::unique_ptr<BuildNode> child[2];
+		std::vector<int> tris;
+	};
 
-/*
-* Global functions
-*/
+	enum { Bins = 32, MaxLeaf = 4, MaxDepth = 60 };
 
-Vec radiance(const Ray &r, const Sphere &s, Vec xN, int depth, bool flag);
-Vec reflectedRadiance(const Ray &r, const Sphere &s, Vec xN, int depth, bool flag);
-Vec directRadiance(const Ray &r, const Sphere &s, const Sphere &lSource, Vec xN, int depth);
-Vec indirectRadiance1(const Ray &r, const Sphere &s, Vec xN, int depth);
-void luminaireSample(const Sphere &s, Vec &i, Vec &ni, double &pdf);
-int visible(const Ray &r, const Ray &n);
+	SBVHBuilder(const std::vector<Vec> &P_, const std::vector<int> &I_, bool spatial_, double budget) :
+		P(P_), I(I_), spatial(spatial_) {
+		duplicatesLeft = (long long)(budget * (I.size() / 3));
+	}
 
-Vec indirectRadiance2(const Ray &r, const Sphere &s, Vec xN, int depth);
+	// boxes, if given, replace the triangle bounds (e.g. for displaced patches)
+	// and rule out spatial splits since clipping assumes flat triangles
+	void build(BVH &bvh, const std::vector<AABB> *boxes = 0) {
+		std::vector<Ref> refs(boxes ? boxes->size() : I.size() / 3);
+		AABB box;
+		if (boxes) spatial = false;
+		for (size_t t = 0; t < refs.size(); t++) {
+			refs[t].tri = int(t);
+			if (boxes) refs[t].box = (*boxes)[t];
+			else for (int k = 0; k < 3; k++) refs[t].box.grow(P[I[3 * t + k]]);
+			box.grow(refs[t].box);
+		}
+		rootArea = box.area();
+		std::unique_ptr<BuildNode> root = buildNode(refs, box, 0);
+		bvh.nodes.clear();
+		bvh.prims.clear();
+		flatten(root.get(), bvh);
+	}
 
+	double sah(const BVH &bvh) const {
+		double cost = 0, root = bvh.nodes.empty() ? 1 : bvh.nodes[0].box.area();
+		for (size_t i = 0; i < bvh.nodes.size(); i++)
+			cost += bvh.nodes[i].box.area() / root * (bvh.nodes[i].count ? bvh.nodes[i].count : 1);
+		return cost;
+	}
 
-bool intersect(const Ray &r, double &t, int &id) {
-	double n = sizeof(spheres) / sizeof(Sphere), d, inf = t = 1e20;
-	for (int i = int(n); i--;) if ((d = spheres[i].intersect(r)) && d<t) { t = d; id = i; }
-	return t<inf;
-}
+private:
+	struct Split {
+		double cost = 1e30;
+		int axis = -1;
+		double pos = 0;         // object split: centroid bin boundary, spatial split: plane
+		bool spatial = false;
+		AABB left, right;
+	};
 
+	std::unique_ptr<BuildNode> buildNode(std::vector<Ref> &refs, const AABB &box, int depth) {
+		std::unique_ptr<BuildNode> node(new BuildNode());
+		node->box = box;
+		const int n = int(refs.size());
+		if (n <= MaxLeaf || depth >= MaxDepth) return makeLeaf(node, refs);
 
-/*
-* KEY FUNCTION: radiance estimator
-*/
+		Split best = objectSplit(refs);
+		if (spatial && duplicatesLeft.load() > 0 && best.axis >= 0 &&
+			best.left.overlap(best.right).area() > 1e-5 * rootArea) {
+			Split s = spatialSplit(refs, box);
+			if (s.cost < best.cost) best = s;
+		}
+		if (best.axis < 0 || (best.cost >= n && n <= 16)) return makeLeaf(node, refs);
 
-Vec receivedRadiance(const Ray &r, int depth, bool flag) {		// r has the current  position and the direction of the ray pointing to the previous x poistion
-	double t;                                   // Distance to intersection
-	int id = 0;                                 // id of intersected sphere
+		std::vector<Ref> left, right;
+		partition(refs, best, left, right);
+		if (left.empty() || right.empty()) {
+			// degenerate split: halve the list so the recursion still terminates
+			left.assign(refs.begin(), refs.begin() + n / 2);
+			right.assign(refs.begin() + n / 2, refs.end());
+		}
+		std::vector<Ref>().swap(refs);
+		node->splitAxis = best.axis < 0 ? 0 : best.axis;
 
-	if (!intersect(r, t, id)) return Vec();   // if miss, return black
-	const Sphere &obj = spheres[id];            // the hit object
+		AABB lb, rb;
+		for (size_t k = 0; k < left.size(); k++) lb.grow(left[k].box);
+		for (size_t k = 0; k < right.size(); k++) rb.grow(right[k].box);
+		if (left.size() + right.size() > 4096) {
+			// large subtrees are built as tasks (fork/join on the shared scheduler)
+			TaskRef t = scheduler.spawn([&]() { node->child[1] = buildNode(right, rb, depth + 1); });
+			node->child[0] = buildNode(left, lb, depth + 1);
+			scheduler.wait(t);
+		}
+		else {
+			node->child[0] = buildNode(left, lb, depth + 1);
+			node->child[1] = buildNode(right, rb, depth + 1);
+		}
+		return node;
+	}
 
-	Vec x = r.o + r.d*t;                        // The intersection point  //x1
-	Vec o = (Vec() - r.d).normalize();          // The outgoing direction (= -r.d)  //wicurr
+	std::unique_ptr<BuildNode> makeLeaf(std::unique_ptr<BuildNode> &node, const std::vector<Ref> &refs) {
+		for (size_t k = 0; k < refs.size(); k++) node->tris.push_back(refs[k].tri);
+		return std::move(node);
+	}
 
-	Vec n = (x - obj.p).normalize();            // The normal direction	//n at x
-	if (n.dot(o) < 0) n = n*-1.0;
+	Split objectSplit(const std::vector<Ref> &refs) const {
+		Split best;
+		AABB cbox;
+		for (size_t k = 0; k < refs.size(); k++) cbox.grow(refs[k].box.center());
+		for (int a = 0; a < 3; a++) {
+			double lo = axis(cbox.lo, a), ext = axis(cbox.hi, a) - lo;
+			if (ext <= 0) continue;
+			AABB bins[Bins];
+			int counts[Bins] = { 0 };
+			for (size_t k = 0; k < refs.size(); k++) {
+				int b = std::min(Bins - 1, int((axis(refs[k].box.center(), a) - lo) / ext * Bins));
+				bins[b].grow(refs[k].box);
+				counts[b]++;
+			}
+			sweep(bins, counts, counts, a, best);
+			if (best.axis == a) best.pos = lo + ext * best.pos / Bins;
+		}
+		return best;
+	}
 
-	/*
-	Tips
+	Split spatialSplit(const std::vector<Ref> &refs, const AABB &box) const {
+		Split best;
+		for (int a = 0; a < 3; a++) {
+			double lo = axis(box.lo, a), ext = axis(box.hi, a) - lo;
+			if (ext <= 0) continue;
+			AABB bins[Bins];
+			int entries[Bins] = { 0 }, exits[Bins] = { 0 };
+			for (size_t k = 0; k < refs.size(); k++) {
+				int first = std::min(Bins - 1, std::max(0, int((axis(refs[k].box.lo, a) - lo) / ext * Bins)));
+				int last = std::min(Bins - 1, std::max(first, int((axis(refs[k].box.hi, a) - lo) / ext * Bins)));
+				Ref rest = refs[k];
+				for (int b = first; b < last; b++) {
+					Ref l, r;
+					splitRef(rest, a, lo + ext * (b + 1) / Bins, l, r);
+					bins[b].grow(l.box);
+					rest = r;
+				}
+				bins[last].grow(rest.box);
+				entries[first]++;
+				exits[last]++;
+			}
+			sweep(bins, entries, exits, a, best);
+			if (best.axis == a && !best.spatial) {
+				best.spatial = true;
+				best.pos = lo + ext * best.pos / Bins;
+			}
+		}
+		return best;
+	}
 
-	1. Other useful quantities/variables:
-	Vec Le = obj.e;                             // Emitted radiance
-	const BRDF &brdf = obj.brdf;                // Surface BRDF at x
+	// SAH over the Bins - 1 planes between bins; leftCounts/rightCounts are the
+	// per-bin references starting/ending there. Stores the plane as a bin index
+	void sweep(const AABB *bins, const int *leftCounts, const int *rightCounts, int a, Split &best) const {
+		AABB rightBoxes[Bins];
+		int rightN[Bins];
+		AABB acc;
+		int n = 0;
+		for (int b = Bins - 1; b > 0; b--) {
+			acc.grow(bins[b]);
+			n += rightCounts[b];
+			rightBoxes[b] = acc;
+			rightN[b] = n;
+		}
+		const double area = std::max(1e-30, parentArea(bins));
+		acc = AABB();
+		n = 0;
+		for (int b = 1; b < Bins; b++) {
+			acc.grow(bins[b - 1]);
+			n += leftCounts[b - 1];
+			if (!n || !rightN[b]) continue;
+			double cost = 1.0 + (acc.area() * n + rightBoxes[b].area() * rightN[b]) / area;
+			if (cost < best.cost) {
+				best.cost = cost;
+				best.axis = a;
+				best.pos = b;
+				best.spatial = false;
+				best.left = acc;
+				best.right = rightBoxes[b];
+			}
+		}
+	}
 
-	2. Call brdf.sample() to sample an incoming direction and continue the recursion
-	*/
+	static double parentArea(const AABB *bins) {
+		AABB box;
+		for (int b = 0; b < Bins; b++) box.grow(bins[b]);
+		return box.area();
+	}
+
+	void partition(const std::vector<Ref> &refs, const Split &s, std::vector<Ref> &left, std::vector<Ref> &right) {
+		for (size_t k = 0; k < refs.size(); k++) {
+			const Ref &ref = refs[k];
+			if (!s.spatial) {
+				(axis(ref.box.center(), s.axis) < s.pos ? left : right).push_back(ref);
+			}
+			else if (axis(ref.box.hi, s.axis) <= s.pos) left.push_back(ref);
+			else if (axis(ref.box.lo, s.axis) >= s.pos) right.push_back(ref);
+			else {
+				Ref l, r;
+				splitRef(ref, s.axis, s.pos, l, r);
+				if (l.box.valid()) left.push_back(l);
+				if (r.box.valid()) right.push_back(r);
+				if (l.box.valid() && r.box.valid()) duplicatesLeft--;
+			}
+		}
+	}
+
+	// clips the triangle of ref at the plane axis = pos into the two halves of its box
+	void splitRef(const Ref &ref, int a, double pos, Ref &left, Ref &right) const {
+		left.tri = right.tri = ref.tri;
+		left.box = right.box = AABB();
+		for (int k = 0; k < 3; k++) {
+			const Vec &v0 = P[I[3 * ref.tri + k]], &v1 = P[I[3 * ref.tri + (k + 1) % 3]];
+			double p0 = axis(v0, a), p1 = axis(v1, a);
+			if (p0 <= pos) left.box.grow(v0);
+			if (p0 >= pos) right.box.grow(v0);
+			if ((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos)) {
+				Vec c = v0 + (v1 - v0) * ((pos - p0) / (p1 - p0));
+				setAxis(c, a, pos);
+				left.box.grow(c);
+				right.box.grow(c);
+			}
+		}
+		AABB lb = ref.box, rb = ref.box;
+		setAxis(lb.hi, a, std::min(axis(lb.hi, a), pos));
+		setAxis(rb.lo, a, std::max(axis(rb.lo, a), pos));
+		left.box = left.box.overlap(lb);
+		right.box = right.box.overlap(rb);
+	}
+
+	void flatten(const BuildNode *node, BVH &bvh) const {
+		int index = int(bvh.nodes.size());
+		bvh.nodes.push_back(BVHNode());
+		bvh.nodes[index].box = node->box;
+		bvh.nodes[index].splitAxis = node->splitAxis;
+		if (!node->child[0]) {
+			bvh.nodes[index].start = int(bvh.prims.size());
+			bvh.nodes[index].count = int(node->tris.size());
+			bvh.prims.insert(bvh.prims.end(), node->tris.begin(), node->tris.end());
+			return;
+		}
+		bvh.nodes[index].count = 0;
+		flatten(node->child[0].get(), bvh);
+		bvh.nodes[index].second = int(bvh.nodes.size());
+		flatten(node->child[1].get(), bvh);
+	}
+
+	const std::vector<Vec> &P;
+	const std::vector<int> &I;
+	bool spatial;
+	double rootArea = 1;
+	std::atomic<long long> duplicatesLeft;
+};
+
+// the closest hit found so far along a ray: distance, what was hit (a sphere
+// index, or a mesh after the spheres), the triangle or patch within a mesh and
+// barycentrics in it. Everything else is derived on demand by Interaction
+struct Hit {
+	double t = 1e20;
+	int id = -1, prim = 0;
+	float u = 0, v = 0;
+};
+
+// Moller-Trumbore; returns distance, 0 if no hit, and the barycentrics of v1, v2 in bary
+inline double intersectTriangle(const Ray &r, const Vec &v0, const Vec &v1, const Vec &v2, double *bary = 0) {
+	Vec e1 = v1 - v0, e2 = v2 - v0, pv = r.d.cross(e2);
+	double det = e1.dot(pv);
+	if (std::abs(det) < 1e-12) return 0;
+	double inv = 1.0 / det;
+	Vec tv = r.o - v0;
+	double u = tv.dot(pv) * inv;
+	if (u < 0 || u > 1) return 0;
+	Vec qv = tv.cross(e1);
+	double v = r.d.dot(qv) * inv;
+	if (v < 0 || u + v > 1) return 0;
+	double t = e2.dot(qv) * inv;
+	if (bary) { bary[0] = u; bary[1] = v; }
+	return t > 1e-4 ? t : 0;
+}
+
+// a surface loaded from an OBJ file; the ids of meshes in intersect() follow the spheres
+struct Mesh {
+	Mesh(const BRDF &brdf_) : surface(0, Vec(), Vec(), brdf_) {}
+	virtual ~Mesh() {}
+
+	// Wavefront OBJ: "v" and "f" records only, polygons are fanned into triangles
+	bool load(const char *path, double scale, const Vec &offset) {
+		FILE *f = fopen(path, "r");
+		if (!f) return false;
+		char line[1024];
+		while (fgets(line, sizeof(line), f)) {
+			double x, y, z;
+			if (line[0] == 'v' && line[1] == ' ' && sscanf(line + 2, "%lf %lf %lf", &x, &y, &z) == 3) {
+				positions.push_back(Vec(x, y, z) * scale + offset);
+			}
+			else if (line[0] == 'f' && line[1] == ' ') {
+				std::vector<int> face;
+				for (char *tok = strtok(line + 2, " \t\r\n"); tok; tok = strtok(0, " \t\r\n")) {
+					int v = atoi(tok);
+					face.push_back(v < 0 ? int(positions.size()) + v : v - 1);
+				}
+				for (size_t k = 2; k < face.size(); k++) {
+					indices.push_back(face[0]);
+					indices.push_back(face[k - 1]);
+					indices.push_back(face[k]);
+				}
+			}
+		}
+		fclose(f);
+		return !indices.empty();
+	}
+
+	virtual void prepare(bool spatialSplits, double duplicateBudget) = 0;
+	// shortens hit.t and fills prim/u/v if the ray hits closer; the caller sets hit.id
+	virtual bool intersect(const Ray &r, Hit &hit) const = 0;
+	// distance to one primitive, 0 if missed or not addressable on its own
+	virtual double intersectPrim(const Ray &, int) const { return 0; }
+	// clears the bits of live rays of p blocked before their tmax; blocker gets
+	// the primitive (or -1 where it cannot be addressed on its own)
+	virtual void occlude(const RayPacket &p, unsigned &live, int *blocker) const {
+		for (int k = 0; k < p.count; k++) {
+			Hit hit;
+			hit.t = p.limit(k);
+			if ((live >> k & 1) && intersect(p.rays[k], hit)) { live &= ~(1u << k); blocker[k] = -1; }
+		}
+	}
+	virtual Vec normal(int prim) const = 0;
+	virtual void report() const {}
+
+	Sphere surface;                 // carries the mesh's BRDF and emission for the integrator
+	std::vector<Vec> positions;
+	std::vector<int> indices;
+};
+
+/*
+* Compressed mesh storage: positions quantized to 16 or 21 bits per axis
+* inside the mesh bounds, 32-bit octahedral normals (Cigolle et al. 2014) and
+* per-leaf delta/varint coded triangle lists, decoded in the intersection loop.
+*/
+
+struct QuantizedPositions {
+	void encode(const std::vector<Vec> &P, int bits_) {
+		bits = bits_;
+		AABB box;
+		for (size_t v = 0; v < P.size(); v++) box.grow(P[v]);
+		const double levels = double((1u << bits) - 1);
+		lo = box.lo;
+		Vec ext = box.hi - box.lo;
+		step = Vec(ext.x / levels, ext.y / levels, ext.z / levels);
+		packed16.clear();
+		packed21.clear();
+		for (size_t v = 0; v < P.size(); v++) {
+			unsigned q[3];
+			for (int a = 0; a < 3; a++) {
+				double s = axis(step, a);
+				q[a] = s > 0 ? unsigned(std::min(levels, std::floor((axis(P[v], a) - axis(lo, a)) / s + 0.5))) : 0;
+			}
+			if (bits == 16) for (int a = 0; a < 3; a++) packed16.push_back(uint16_t(q[a]));
+			else packed21.push_back(uint64_t(q[0]) | uint64_t(q[1]) << 21 | uint64_t(q[2]) << 42);
+		}
+	}
+
+	Vec operator[](int v) const {
+		if (bits == 16) {
+			const uint16_t *q = &packed16[3 * v];
+			return Vec(lo.x + q[0] * step.x, lo.y + q[1] * step.y, lo.z + q[2] * step.z);
+		}
+		uint64_t q = packed21[v];
+		const uint64_t mask = (1u << 21) - 1;
+		return Vec(lo.x + (q & mask) * step.x, lo.y + (q >> 21 & mask) * step.y, lo.z + (q >> 42 & mask) * step.z);
+	}
+
+	size_t bytes() const { return packed16.size() * sizeof(uint16_t) + packed21.size() * sizeof(uint64_t); }
+
+	int bits = 0;
+	Vec lo, step;
+	std::vector<uint16_t> packed16;    // 6 bytes per vertex
+	std::vector<uint64_t> packed21;    // 8 bytes per vertex
+};
+
+// unit vector to two 16-bit coordinates on the octahedron folded into a square
+inline uint32_t octEncode(const Vec &n) {
+	double l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	double u = n.x / l1, v = n.y / l1;
+	if (n.z < 0) {
+		double fu = (1 - std::abs(v)) * (u >= 0 ? 1 : -1), fv = (1 - std::abs(u)) * (v >= 0 ? 1 : -1);
+		u = fu; v = fv;
+	}
+	auto quantize = [](double c) { return uint32_t(std::floor((c * 0.5 + 0.5) * 65535 + 0.5)); };
+	return quantize(u) | quantize(v) << 16;
+}
+
+inline Vec octDecode(uint32_t e) {
+	double u = (e & 0xffff) / 65535.0 * 2 - 1, v = (e >> 16) / 65535.0 * 2 - 1;
+	Vec n(u, v, 1 - std::abs(u) - std::abs(v));
+	if (n.z < 0) {
+		double fu = (1 - std::abs(v)) * (u >= 0 ? 1 : -1), fv = (1 - std::abs(u)) * (v >= 0 ? 1 : -1);
+		n.x = fu; n.y = fv;
+	}
+	return n.normalize();
+}
+
+// zigzag varints: small deltas of either sign take one or two bytes
+inline void putDelta(std::vector<uint8_t> &out, long long delta) {
+	unsigned long long z = (unsigned long long)(delta << 1) ^ (unsigned long long)(delta >> 63);
+	while (z >= 0x80) { out.push_back(uint8_t(z | 0x80)); z >>= 7; }
+	out.push_back(uint8_t(z));
+}
+
+inline long long getDelta(const uint8_t *&in) {
+	unsigned long long z = 0;
+	for (int shift = 0;; shift += 7) {
+		uint8_t b = *in++;
+		z |= (unsigned long long)(b & 0x7f) << shift;
+		if (b < 0x80) break;
+	}
+	return (long long)(z >> 1) ^ -(long long)(z & 1);
+}
+
+struct TriangleMesh : public Mesh {
+	// quantizeBits 16 or 21 stores the mesh compressed, 0 keeps full precision
+	TriangleMesh(const BRDF &brdf_, int quantizeBits_ = 0) : Mesh(brdf_), quantizeBits(quantizeBits_) {}
+
+	void prepare(bool spatialSplits, double duplicateBudget) {
+		if (!quantizeBits) {
+			buildBVH(spatialSplits, duplicateBudget);
+			return;
+		}
+		size_t before = positions.size() * sizeof(Vec) + indices.size() * sizeof(int);
+		std::vector<uint32_t> encoded;
+		for (size_t t = 0; t < indices.size(); t += 3) encoded.push_back(octEncode(normal(int(t / 3))));
+		normals.swap(encoded);
+		// the BVH bounds the decoded triangles, so build it on the quantized positions
+		quantized.encode(positions, quantizeBits);
+		for (size_t v = 0; v < positions.size(); v++) positions[v] = quantized[int(v)];
+		buildBVH(spatialSplits, duplicateBudget);
+		before += bvh.prims.size() * sizeof(int);
+
+		// each leaf becomes a run of (triangle, 3 vertex) deltas starting from zero
+		for (size_t i = 0; i < bvh.nodes.size(); i++) {
+			BVHNode &node = bvh.nodes[i];
+			if (!node.count) continue;
+			std::vector<int> tris(bvh.prims.begin() + node.start, bvh.prims.begin() + node.start + node.count);
+			std::sort(tris.begin(), tris.end());
+			node.start = int(stream.size());
+			long long prevTri = 0, prevVertex = 0;
+			for (size_t k = 0; k < tris.size(); k++) {
+				putDelta(stream, tris[k] - prevTri);
+				prevTri = tris[k];
+				for (int c = 0; c < 3; c++) {
+					putDelta(stream, indices[3 * tris[k] + c] - prevVertex);
+					prevVertex = indices[3 * tris[k] + c];
+				}
+			}
+		}
+		size_t references = bvh.prims.size();
+		std::vector<Vec>().swap(positions);
+		std::vector<int>().swap(indices);
+		std::vector<int>().swap(bvh.prims);
+		size_t after = quantized.bytes() + normals.size() * sizeof(uint32_t) + stream.size();
+		fprintf(stderr, "Compressed mesh: %.2f MB -> %.2f MB (%d-bit positions, %.2f index bytes per reference)\n",
+			before / 1048576.0, after / 1048576.0, quantizeBits, double(stream.size()) / std::max<size_t>(1, references));
+	}
+
+	void buildBVH(bool spatialSplits, double duplicateBudget) {
+		auto start = std::chrono::steady_clock::now();
+		SBVHBuilder builder(positions, indices, spatialSplits, duplicateBudget);
+		builder.build(bvh);
+		int leaves = 0;
+		for (size_t i = 0; i < bvh.nodes.size(); i++) leaves += bvh.nodes[i].count > 0;
+		fprintf(stderr, "%s: %d triangles, %d nodes, %d leaves, %d references (+%.1f%%), SAH %.2f, %.3fs\n",
+			spatialSplits ? "SBVH" : "BVH", int(indices.size() / 3), int(bvh.nodes.size()), leaves,
+			int(bvh.prims.size()), 100.0 * (bvh.prims.size() * 3.0 / indices.size() - 1.0), builder.sah(bvh),
+			std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	double intersectTriangle(const Ray &r, int tri, double *bary) const {
+		return ::intersectTriangle(r, positions[indices[3 * tri]], positions[indices[3 * tri + 1]], positions[indices[3 * tri + 2]], bary);
+	}
+
+	// compressed meshes only keep vertex indices inside the leaf streams
+	double intersectPrim(const Ray &r, int tri) const {
+		return quantizeBits ? 0 : intersectTriangle(r, tri, 0);
+	}
+
+	void occlude(const RayPacket &p, unsigned &live, int *blocker) const {
+		if (quantizeBits) {
+			Mesh::occlude(p, live, blocker);
+			return;
+		}
+		bvh.traversePacket(p, live, [&](int start, int count, unsigned active, unsigned &alive) {
+			for (int j = start; j < start + count; j++) {
+				const int tri = bvh.prims[j];
+				const Vec &v0 = positions[indices[3 * tri]], &v1 = positions[indices[3 * tri + 1]], &v2 = positions[indices[3 * tri + 2]];
+				for (int g = 0; g < RayPacket::Groups; g++) {
+					unsigned lanes = RayPacket::group(active & alive, g);
+					if (!lanes) continue;
+					for (unsigned m = lanes & p.blockedBy(v0, v1, v2, g); m; m &= m - 1) {
+						int k = g * RayPacket::Width + __builtin_ctz(m);
+						alive &= ~(1u << k);
+						blocker[k] = tri;
+					}
+				}
+			}
+		});
+	}
+
+	bool intersect(const Ray &r, Hit &hit) const {
+		if (quantizeBits) {
+			return bvh.traverse(r, hit.t, [&](int start, int count, double &tmax) {
+				bool found = false;
+				const uint8_t *in = &stream[start];
+				long long tri = 0, vertex = 0;
+				for (int k = 0; k < count; k++) {
+					tri += getDelta(in);
+					Vec v[3];
+					for (int c = 0; c < 3; c++) v[c] = quantized[int(vertex += getDelta(in))];
+					double bary[2], d = ::intersectTriangle(r, v[0], v[1], v[2], bary);
+					if (d && d < tmax) { tmax = d; hit.prim = int(tri); hit.u = bary[0]; hit.v = bary[1]; found = true; }
+				}
+				return found;
+			});
+		}
+		return bvh.traverse(r, hit.t, [&](int start, int count, double &tmax) {
+			bool found = false;
+			for (int k = start; k < start + count; k++) {
+				double bary[2], d = intersectTriangle(r, bvh.prims[k], bary);
+				if (d && d < tmax) { tmax = d; hit.prim = bvh.prims[k]; hit.u = bary[0]; hit.v = bary[1]; found = true; }
+			}
+			return found;
+		});
+	}
+
+	Vec normal(int tri) const {
+		if (!normals.empty()) return octDecode(normals[tri]);
+		const Vec &v0 = positions[indices[3 * tri]], &v1 = positions[indices[3 * tri + 1]], &v2 = positions[indices[3 * tri + 2]];
+		return (v1 - v0).cross(v2 - v0).normalize();
+	}
+
+	BVH bvh;
+	int quantizeBits;
+	QuantizedPositions quantized;
+	std::vector<uint32_t> normals;     // octahedral, per triangle
+	std::vector<uint8_t> stream;       // compressed leaves; BVHNode::start is a byte offset
+};
+
+/*
+* Subdivision surfaces with displacement, tessellated lazily: the control
+* triangles are bounded conservatively and only diced into micro-triangles
+* when a ray first enters a patch's box. Tessellations live in an LRU cache
+* with a memory budget, sharded by patch so threads rarely share a lock.
+*/
+
+struct Tessellation {
+	size_t bytes() const {
+		return sizeof(*this) + positions.size() * sizeof(Vec) + indices.size() * sizeof(int) +
+			bvh.nodes.size() * sizeof(BVHNode) + bvh.prims.size() * sizeof(int);
+	}
+
+	std::vector<Vec> positions;
+	std::vector<int> indices;
+	BVH bvh;
+};
+
+typedef std::shared_ptr<const Tessellation> TessellationRef;
+
+struct TessellationCache {
+	enum { Shards = 16 };
+
+	void init(size_t budgetBytes) {
+		shardBudget = budgetBytes / Shards;
+	}
+
+	// the cached tessellation of patch, or one made by tessellate() on a miss;
+	// evicted entries stay alive while a thread still holds their reference
+	template <typename Make>
+	TessellationRef get(int patch, Make tessellate) {
+		Shard &shard = shards[patch % Shards];
+		{
+			std::lock_guard<std::mutex> guard(shard.lock);
+			auto it = shard.entries.find(patch);
+			if (it != shard.entries.end()) {
+				shard.lru.splice(shard.lru.begin(), shard.lru, it->second.second);
+				hits++;
+				return it->second.first;
+			}
+		}
+		// tessellate outside the lock; if another thread raced us the first insert wins
+		TessellationRef tess = tessellate();
+		std::lock_guard<std::mutex> guard(shard.lock);
+		auto it = shard.entries.find(patch);
+		if (it != shard.entries.end()) return it->second.first;
+		misses++;
+		shard.lru.push_front(patch);
+		shard.entries[patch] = std::make_pair(tess, shard.lru.begin());
+		shard.bytes += tess->bytes();
+		totalBytes += tess->bytes();
+		while (shard.bytes > shardBudget && shard.lru.size() > 1) {
+			auto victim = shard.entries.find(shard.lru.back());
+			shard.bytes -= victim->second.first->bytes();
+			totalBytes -= victim->second.first->bytes();
+			shard.entries.erase(victim);
+			shard.lru.pop_back();
+			evictions++;
+		}
+		size_t total = totalBytes, peak = peakBytes;
+		while (total > peak && !peakBytes.compare_exchange_weak(peak, total)) {}
+		return tess;
+	}
+
+	struct alignas(64) Shard {
+		std::mutex lock;
+		std::list<int> lru;     // most recently used first
+		std::unordered_map<int, std::pair<TessellationRef, std::list<int>::iterator>> entries;
+		size_t bytes = 0;
+	};
+
+	Shard shards[Shards];
+	size_t shardBudget = 0;
+	std::atomic<long long> hits{ 0 }, misses{ 0 }, evictions{ 0 };
+	std::atomic<size_t> totalBytes{ 0 }, peakBytes{ 0 };
+};
+
+struct SubdivisionMesh : public Mesh {
+	SubdivisionMesh(const BRDF &brdf_, int level_, double amplitude_, double frequency_, size_t cacheBytes) :
+		Mesh(brdf_), level(level_), amplitude(amplitude_), frequency(frequency_) {
+		cache.init(cacheBytes);
+	}
+
+	// the patch bounds: the PN control net contains the smooth patch, and the
+	// displacement moves it at most |amplitude| along the unit normal
+	void prepare(bool, double) {
+		auto start = std::chrono::steady_clock::now();
+		vertexNormals.assign(positions.size(), Vec());
+		for (size_t t = 0; t < indices.size(); t += 3) {
+			const Vec &a = positions[indices[t]], &b = positions[indices[t + 1]], &c = positions[indices[t + 2]];
+			Vec n = (b - a).cross(c - a);   // area weighted
+			for (int k = 0; k < 3; k++) vertexNormals[indices[t + k]] = vertexNormals[indices[t + k]] + n;
+		}
+		for (size_t v = 0; v < vertexNormals.size(); v++) vertexNormals[v].normalize();
+
+		std::vector<AABB> boxes(indices.size() / 3);
+		for (size_t patch = 0; patch < boxes.size(); patch++) {
+			Vec b[10];
+			controlNet(int(patch), b);
+			for (int k = 0; k < 10; k++) boxes[patch].grow(b[k]);
+			Vec pad(std::abs(amplitude), std::abs(amplitude), std::abs(amplitude));
+			boxes[patch].lo = boxes[patch].lo - pad;
+			boxes[patch].hi = boxes[patch].hi + pad;
+		}
+		SBVHBuilder(positions, indices, false, 0).build(patchBVH, &boxes);
+		fprintf(stderr, "Subdivision: %d patches at level %d (%d micro-triangles each), %.3fs\n",
+			int(boxes.size()), level, level * level,
+			std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	// prim encodes patch * level^2 + micro-triangle
+	// (u, v are barycentrics in the micro-triangle)
+	bool intersect(const Ray &r, Hit &hit) const {
+		return patchBVH.traverse(r, hit.t, [&](int start, int count, double &tmax) {
+			bool found = false;
+			for (int k = start; k < start + count; k++) {
+				int patch = patchBVH.prims[k];
+				TessellationRef tess = tessellation(patch);
+				int micro = 0;
+				double bary[2], hitBary[2] = { 0, 0 };
+				if (tess->bvh.traverse(r, tmax, [&](int s, int c, double &tm) {
+					bool h = false;
+					for (int m = s; m < s + c; m++) {
+						int tri = tess->bvh.prims[m];
+						double d = intersectTriangle(r, tess->positions[tess->indices[3 * tri]],
+							tess->positions[tess->indices[3 * tri + 1]], tess->positions[tess->indices[3 * tri + 2]], bary);
+						if (d && d < tm) { tm = d; micro = tri; hitBary[0] = bary[0]; hitBary[1] = bary[1]; h = true; }
+					}
+					return h;
+				})) {
+					hit.prim = patch * level * level + micro;
+					hit.u = hitBary[0];
+					hit.v = hitBary[1];
+					found = true;
+				}
+			}
+			return found;
+		});
+	}
+
+	Vec normal(int prim) const {
+		TessellationRef tess = tessellation(prim / (level * level));
+		int tri = prim % (level * level);
+		const Vec &v0 = tess->positions[tess->indices[3 * tri]], &v1 = tess->positions[tess->indices[3 * tri + 1]],
+			&v2 = tess->positions[tess->indices[3 * tri + 2]];
+		return (v1 - v0).cross(v2 - v0).normalize();
+	}
+
+	void report() const {
+		fprintf(stderr, "Tessellation cache: %lld hits, %lld misses, %lld evictions, peak %.1f MB\n",
+			cache.hits.load(), cache.misses.load(), cache.evictions.load(), cache.peakBytes.load() / 1048576.0);
+	}
+
+private:
+	// cubic Bezier control points of the PN triangle (Vlachos et al. 2001):
+	// b300, b030, b003, b210, b120, b021, b012, b102, b201, b111
+	void controlNet(int patch, Vec *b) const {
+		const Vec *p[3], *n[3];
+		for (int k = 0; k < 3; k++) {
+			p[k] = &positions[indices[3 * patch + k]];
+			n[k] = &vertexNormals[indices[3 * patch + k]];
+		}
+		auto edge = [&](int i, int j) {   // control point 1/3 along edge i->j, pulled onto the tangent plane of i
+			Vec d = *p[j] - *p[i];
+			return (*p[i] * 2 + *p[j] - *n[i] * d.dot(*n[i])) * (1.0 / 3);
+		};
+		b[0] = *p[0]; b[1] = *p[1]; b[2] = *p[2];
+		b[3] = edge(0, 1); b[4] = edge(1, 0);
+		b[5] = edge(1, 2); b[6] = edge(2, 1);
+		b[7] = edge(2, 0); b[8] = edge(0, 2);
+		Vec e, v = (*p[0] + *p[1] + *p[2]) * (1.0 / 3);
+		for (int k = 3; k < 9; k++) e = e + b[k] * (1.0 / 6);
+		b[9] = e + (e - v) * 0.5;
+	}
+
+	// smooth position and normal at barycentrics (u, v, w) of the patch, displaced along the normal
+	Vec evaluate(int patch, const Vec *b, double u, double v, double w) const {
+		Vec x = b[0] * (w*w*w) + b[1] * (u*u*u) + b[2] * (v*v*v) +
+			b[3] * (3 * w*w*u) + b[4] * (3 * w*u*u) + b[5] * (3 * u*u*v) + b[6] * (3 * u*v*v) +
+			b[7] * (3 * v*v*w) + b[8] * (3 * v*w*w) + b[9] * (6 * w*u*v);
+		Vec n = (vertexNormals[indices[3 * patch]] * w + vertexNormals[indices[3 * patch + 1]] * u +
+			vertexNormals[indices[3 * patch + 2]] * v).normalize();
+		return x + n * displacement(x);
+	}
+
+	// procedural displacement; depends on position only so shared edges stay watertight
+	double displacement(const Vec &x) const {
+		return amplitude * sin(frequency * x.x) * sin(frequency * x.y) * sin(frequency * x.z);
+	}
+
+	TessellationRef tessellation(int patch) const {
+		return cache.get(patch, [&]() {
+			std::shared_ptr<Tessellation> tess(new Tessellation());
+			Vec b[10];
+			controlNet(patch, b);
+			const int n = level;
+			// row i holds n - i + 1 vertices; vertex (i, j) has barycentrics (j / n, i / n)
+			std::vector<int> row(n + 2);
+			for (int i = 0; i <= n; i++) {
+				row[i] = int(tess->positions.size());
+				for (int j = 0; j <= n - i; j++) {
+					double u = double(j) / n, v = double(i) / n;
+					tess->positions.push_back(evaluate(patch, b, u, v, std::max(0.0, 1 - u - v)));
+				}
+			}
+			for (int i = 0; i < n; i++) {
+				for (int j = 0; j < n - i; j++) {
+					int a = row[i] + j, c = row[i + 1] + j;
+					int tri[6] = { a, a + 1, c, a + 1, c + 1, c };
+					tess->indices.insert(tess->indices.end(), tri, tri + (j < n - i - 1 ? 6 : 3));
+				}
+			}
+			SBVHBuilder(tess->positions, tess->indices, false, 0).build(tess->bvh);
+			return TessellationRef(tess);
+		});
+	}
+
+
+	int level;
+	double amplitude, frequency;
+	std::vector<Vec> vertexNormals;
+	BVH patchBVH;
+	mutable TessellationCache cache;
+};
+
+
+/*
+* Sampling functions
+*/
+
+inline void createLocalCoord(const Vec &n, Vec &u, Vec &v, Vec &w) {
+	w = n;
+	u = ((std::abs(w.x)>.1 ? Vec(0, 1) : Vec(1)).cross(w)).normalize();
+	v = w.cross(u);
+}
+
+
+/*
+* Path regularization: delta lobes are mollified into a cone around the mirror
+* direction so that next-event estimation can see light through mirrors
+* (light -> mirror -> diffuse -> camera). The cone shrinks with every sample
+* of a pixel, r_k = r_0 * k^(-1/4) for its k-th sample, so the image
+* converges to the unregularized one however the samples are split in passes.
+*/
+
+struct Regularization {
+	double angle(int sample) const {
+		return enabled ? initialAngle * pow(sample + 1.0, -0.25) : 0.0;
+	}
+
+	// sets the cone half-angle the calling thread uses for its next sample
+	void begin(int sample) const { current = angle(sample); }
+
+	static bool active() { return current > 0; }
+
+	bool enabled = false;
+	double initialAngle = 0.2;          // radians
+	static thread_local double current;
+} regularization;
+
+thread_local double Regularization::current = 0.0;
+
+
+/*
+* BRDFs   (each had it's own structure)
+*/
+
+// Ideal diffuse BRDF
+struct DiffuseBRDF : public BRDF {
+	DiffuseBRDF(Vec kd_) : kd(kd_) {}
+
+	Vec eval(const Vec &n, const Vec &o, const Vec &i) const {
+		return kd * (1.0 / PI);
+	}
+
+	void sample(const Vec &n, const Vec &o, Vec &i, double &pdf) const {		//SAMPLE IMPLEMENTATION
+		// double precision: Sphere::intersect() assumes unit directions, and float ones drift off the surface
+		double z, r, x, y, phi;
+		z = sqrt(rng());
+		r = sqrt(1.0 - (z * z));
+		phi = 2.0 * PI * rng();
+		x = r * cos(phi);
+		y = r * sin(phi);
+		Vec u1, v1, w1;
+		createLocalCoord(n, u1, v1, w1);
+		i = u1*x + v1*y + w1*z;
+		pdf = i.dot(n) / PI;
+	}
+
+	bool isSpecular() const {
+		return false;
+	}
+
+	Vec albedo() const { return kd; }
+	void setAlbedo(const Vec &a) { kd = a; }
+
+	Vec kd;
+};
+
+//Ideal specular BRDF
+struct SpecularBRDF : public BRDF {
+	SpecularBRDF(Vec ks_) : ks(ks_) {}
+
+	Vec eval(const Vec &n, const Vec &o, const Vec &i) const {
+		Vec tempVec = mirroredDirection(n, o);
+		if (Regularization::active()) {
+			// uniform over the cone around the mirror direction, so eval*cos/pdf = ks
+			double cosMax = cos(Regularization::current), cosI = n.dot(i);
+			if (cosI <= 0 || tempVec.dot(i) < cosMax) return Vec();
+			return ks * (1.0 / (cosI * 2.0 * PI * (1.0 - cosMax)));
+		}
+		double diffX, diffY, diffZ;
+		double epsil = 1e-5;		///Varying Epsilon
+		diffX = abs(double(i.x) - double(tempVec.x));
+		diffY = abs(double(i.y) - double(tempVec.y));
+		diffZ = abs(double(i.z) - double(tempVec.z));
+
+		if (((diffX < epsil) && (diffY < epsil)) && (diffZ < epsil)) {
+			return ks * (1.0 / n.dot(i));
+		}
+		else {
+			return 0.0;
+		}
+
+	}
+
+	void sample(const Vec &n, const Vec &o, Vec &i, double &pdf) const {		//SAMPLE IMPLEMENTATION
+		Vec wi = mirroredDirection(n, o);
+		pdf = 1.0;
+		i = wi;
+		if (Regularization::active()) {
+			double cosMax = cos(Regularization::current);
+			double z = 1.0 - rng() * (1.0 - cosMax), r = sqrt(std::max(0.0, 1.0 - z*z)), phi = 2.0 * PI * rng();
+			Vec u, v, w;
+			createLocalCoord(wi, u, v, w);
+			i = u*(r*cos(phi)) + v*(r*sin(phi)) + w*z;
+			pdf = 1.0 / (2.0 * PI * (1.0 - cosMax));
+		}
+	}
+
+	Vec mirroredDirection(const Vec &n, const Vec &o) const {
+		Vec temp = Vec();
+		temp = (((n * 2.0) * n.dot(o)) - o);
+		return temp;
+	}
+
+	bool isSpecular() const {
+		return true;
+	}
+
+	Vec albedo() const { return ks; }
+	void setAlbedo(const Vec &a) { ks = a; }
+
+	Vec ks;
+};
+
+
+/*
+* Scene configuration
+*/
+
+// Pre-defined BRDFs, editable by name with --edit
+DiffuseBRDF leftWall(Vec(.75, .25, .25)),
+rightWall(Vec(.25, .25, .75)),
+otherWall(Vec(.75, .75, .75)),
+blackSurf(Vec(0.0, 0.0, 0.0)),
+brightSurf(Vec(0.9, 0.9, 0.9));
+
+//Pre-defined Specular BRDF
+SpecularBRDF specBRDF(Vec(0.999, 0.999, 0.999));
+
+// Named materials. While tracking, every shading vertex sets its material's
+// bit in the calling thread's mask, which renderTile() collects per pixel.
+struct MaterialTable {
+	struct Entry { const char *name; BRDF *brdf; };
+
+	MaterialTable() : entries{ { "leftWall", &leftWall }, { "rightWall", &rightWall }, { "otherWall", &otherWall },
+		{ "blackSurf", &blackSurf }, { "brightSurf", &brightSurf }, { "specBRDF", &specBRDF } } {
+		for (size_t k = 0; k < entries.size(); k++) entries[k].brdf->material = int(k);
+	}
+
+	BRDF *find(const char *name) const {
+		for (size_t k = 0; k < entries.size(); k++) if (!strcmp(entries[k].name, name)) return entries[k].brdf;
+		return 0;
+	}
+
+	static void touch(const BRDF &brdf) { if (tracking) touched |= 1ull << brdf.material; }
+
+	static bool tracking;
+	static thread_local unsigned long long touched;
+	std::vector<Entry> entries;
+} materialTable;
+
+bool MaterialTable::tracking = false;
+thread_local unsigned long long MaterialTable::touched = 0;
+
+// Scene: list of spheres; --move and --particles make it dynamic
+std::vector<Sphere> spheres = {
+	Sphere(1e5,  Vec(1e5 + 1,40.8,81.6),   Vec(),         leftWall),   // Left
+	Sphere(1e5,  Vec(-1e5 + 99,40.8,81.6), Vec(),         rightWall),  // Right
+	Sphere(1e5,  Vec(50,40.8, 1e5),      Vec(),         otherWall),  // Back
+	Sphere(1e5,  Vec(50, 1e5, 81.6),     Vec(),         otherWall),  // Bottom
+	Sphere(1e5,  Vec(50,-1e5 + 81.6,81.6), Vec(),         otherWall),  // Top
+	Sphere(16.5, Vec(27,16.5,47),        Vec(),         brightSurf), // Ball 1
+	Sphere(16.5, Vec(73,16.5,78),        Vec(),         specBRDF), // Ball 2
+	Sphere(5.0,  Vec(50,70.0,81.6),      Vec(50,50,50), blackSurf)   // Light
+};
+
+// Triangle meshes loaded with --mesh; their ids in intersect() follow the spheres'
+std::vector<std::unique_ptr<Mesh>> meshes;
+
+// BVH over the spheres. Moving spheres get bounds at both ends of the shutter
+// which traversal interpolates to the ray's time, so a node only covers where
+// its spheres are at that instant rather than their whole swept volume. Fast
+// spheres moving apart still inflate interpolated bounds mid-shutter, so the
+// shutter can be split into segments with a BVH each (uniform temporal splits)
+struct SphereBVH {
+	// nsegments 0 picks one segment per ~4 radii the fastest sphere moves
+	void build(bool sweptBounds, int nsegments) {
+		motion = false;
+		double travel = 0;
+		for (size_t i = 0; i < spheres.size(); i++) {
+			const Vec &v = spheres[i].v;
+			motion |= v.x != 0 || v.y != 0 || v.z != 0;
+			travel = std::max(travel, sqrt(v.dot(v)) / spheres[i].rad);
+		}
+		if (!nsegments) nsegments = std::min(16, std::max(1, int(std::ceil(travel / 4))));
+		if (!motion || sweptBounds) nsegments = 1;
+		linear = !motion && spheres.size() <= 16;
+		segments.assign(nsegments, BVH());
+		for (int k = 0; k < nsegments; k++)
+			buildSegment(segments[k], double(k) / nsegments, double(k + 1) / nsegments, sweptBounds);
+	}
+
+	const BVH &at(double time) const {
+		return segments[std::min(int(segments.size()) - 1, int(time * segments.size()))];
+	}
+
+	std::vector<BVH> segments;
+	bool motion = false;    // any sphere moves, so camera rays need a time
+	bool linear = false;    // a few static spheres, mostly huge walls whose boxes overlap
+	                        // everything: a plain loop beats traversing the tree
+
+private:
+	static AABB bounds(const Sphere &s, double time) {
+		Vec c = s.center(time), r(s.rad, s.rad, s.rad);
+		AABB box;
+		box.grow(c - r);
+		box.grow(c + r);
+		return box;
+	}
+
+	void buildSegment(BVH &bvh, double t0, double t1, bool sweptBounds) {
+		std::vector<AABB> open(spheres.size()), close(spheres.size()), mid(spheres.size());
+		for (size_t i = 0; i < spheres.size(); i++) {
+			open[i] = bounds(spheres[i], t0);
+			close[i] = bounds(spheres[i], t1);
+			mid[i] = bounds(spheres[i], 0.5 * (t0 + t1));
+			if (sweptBounds) open[i].grow(close[i]);
+		}
+		static const std::vector<Vec> noPositions;
+		static const std::vector<int> noIndices;
+		// the topology comes from the spheres at mid-segment, then both ends are
+		// refit; grouping by swept boxes instead lumps fast spheres together
+		SBVHBuilder(noPositions, noIndices, false, 0).build(bvh, sweptBounds ? &open : &mid);
+		bvh.time0 = t0;
+		bvh.time1 = t1;
+		if (!motion || sweptBounds) return;
+		bvh.endBoxes.resize(bvh.nodes.size());
+		for (int i = int(bvh.nodes.size()); i--;) {
+			BVHNode &node = bvh.nodes[i];
+			node.box = bvh.endBoxes[i] = AABB();
+			if (node.count) {
+				for (int k = node.start; k < node.start + node.count; k++) {
+					node.box.grow(open[bvh.prims[k]]);
+					bvh.endBoxes[i].grow(close[bvh.prims[k]]);
+				}
+			}
+			else for (int c : { i + 1, node.second }) {
+				node.box.grow(bvh.nodes[c].box);
+				bvh.endBoxes[i].grow(bvh.endBoxes[c]);
+			}
+		}
+	}
+} sphereBVH;
+
+// Camera position & direction
+Ray cam(Vec(50, 52, 295.6), Vec(0, -0.042612, -1).normalize());   // moved between frames by --frames
+
+
+/*
+* Neural radiance cache (after Mueller et al. 2021), trained online on the
+* CPU: a multiresolution hash grid encodes the position (Mueller et al. 2022)
+* and a 32-32-3 ReLU network maps it, with the normal, viewing direction and
+* albedo, to the radiance reflected at a vertex. A fraction of each pass's
+* paths are traced to full length and record every diffuse vertex with the
+* radiance the path found there; the rest end at the cache once they are
+* deeper than terminateDepth. Kernels are fixed-size loops over contiguous
+* rows so the compiler vectorizes them.
+*/
+
+struct NeuralRadianceCache {
+	enum { Levels = 8, Features = 2, Log2Table = 14, Table = 1 << Log2Table, Width = 32, Outputs = 3 };
+	enum Mode { Off, Train, Query };
+
+	struct Sample {
+		float x[3], n[3], wo[3], albedo[3], target[3];
+	};
+
+	NeuralRadianceCache() {
+		// parameter layout: hash tables, then per layer weights [in][out] and biases
+		offTable = 0;
+		offW1 = offTable + Levels * Table * Features;
+		offB1 = offW1 + Width * Width;
+		offW2 = offB1 + Width;
+		offB2 = offW2 + Width * Width;
+		offW3 = offB2 + Width;
+		offB3 = offW3 + Width * Width;   // output layer padded to Width columns
+		params.assign(offB3 + Width, 0.0f);
+		std::mt19937 init(5);
+		std::uniform_real_distribution<float> small(-1e-4f, 1e-4f), unit(-1.0f, 1.0f);
+		for (int k = offTable; k < offW1; k++) params[k] = small(init);
+		const float he = sqrt(6.0f / Width);
+		for (int k = offW1; k < offB1; k++) params[k] = unit(init) * he;
+		for (int k = offW2; k < offB2; k++) params[k] = unit(init) * he;
+		for (int k = offW3; k < offB3; k++) params[k] = (k - offW3) % Width < Outputs ? unit(init) * he : 0.0f;
+		m.assign(params.size(), 0.0f);
+		v.assign(params.size(), 0.0f);
+		double scale = exp((log(256.0) - log(4.0)) / (Levels - 1));
+		for (int l = 0; l < Levels; l++) resolution[l] = int(4 * pow(scale, l));
+	}
+
+	static bool recording() { return mode == Train; }
+	bool terminates(int depth, bool isSpec) const { return mode == Query && depth > terminateDepth && !isSpec; }
+
+	void record(const Vec &x, const Vec &n, const Vec &wo, const Vec &albedo, const Vec &target) const {
+		Sample s;
+		store(s.x, x); store(s.n, n); store(s.wo, wo); store(s.albedo, albedo); store(s.target, target);
+		sink->push_back(s);
+	}
+
+	Vec query(const Vec &x, const Vec &n, const Vec &wo, const Vec &albedo) const {
+		Sample s;
+		store(s.x, x); store(s.n, n); store(s.wo, wo); store(s.albedo, albedo);
+		Activations a;
+		forward(s, a);
+		return Vec(std::max(0.0f, a.y[0]), std::max(0.0f, a.y[1]), std::max(0.0f, a.y[2]));
+	}
+
+	// one round of Adam steps over the samples of a pass (relative L2 loss)
+	void train(std::vector<Sample> &samples, int pass) {
+		if (samples.empty()) return;
+		if (!boundsSet) {
+			AABB box;
+			for (size_t k = 0; k < samples.size(); k++) box.grow(Vec(samples[k].x[0], samples[k].x[1], samples[k].x[2]));
+			Vec pad = (box.hi - box.lo) * 0.05 + Vec(1e-3, 1e-3, 1e-3);
+			lo = box.lo - pad;
+			Vec ext = box.hi + pad - lo;
+			invExtent = Vec(1 / ext.x, 1 / ext.y, 1 / ext.z);
+			boundsSet = true;
+		}
+		std::mt19937 shuffle(pass);
+		std::shuffle(samples.begin(), samples.end(), shuffle);
+		const int steps = std::min<int>(maxSteps, int(samples.size() / Batch));
+		const int Chunk = 64, chunks = Batch / Chunk;
+		std::vector<std::vector<float>> grads(chunks, std::vector<float>(params.size() - offW1));
+		std::vector<float> encodingGrads(Batch * Levels * Features);
+		std::vector<double> chunkLoss(chunks);
+		double loss = 0;
+		for (int step = 0; step < steps; step++) {
+			const Sample *batch = &samples[step * Batch];
+			scheduler.parallelFor(0, chunks, 1, [&](int begin, int end) {
+				for (int c = begin; c < end; c++) {
+					std::fill(grads[c].begin(), grads[c].end(), 0.0f);
+					chunkLoss[c] = 0;
+					for (int k = c * Chunk; k < (c + 1) * Chunk; k++)
+						chunkLoss[c] += backward(batch[k], &grads[c][0], &encodingGrads[k * Levels * Features]);
+				}
+			});
+			// fixed reduction order, so training does not depend on the thread count
+			for (int c = 1; c < chunks; c++)
+				for (size_t k = 0; k < grads[0].size(); k++) grads[0][k] += grads[c][k];
+			for (int c = 0; c < chunks; c++) loss += chunkLoss[c];
+			std::vector<float> &g = grads[0];
+			std::vector<float> tableGrad(offW1, 0.0f);
+			for (int k = 0; k < Batch; k++) scatterEncoding(batch[k], &encodingGrads[k * Levels * Features], tableGrad);
+			adam(&tableGrad[0], offTable, offW1);
+			adam(&g[0], offW1, int(params.size()));
+		}
+		lastLoss = steps ? loss / (steps * Batch) : 0;
+		trained = trained || steps > 0;
+	}
+
+	int terminateDepth = 2;     // paths end at the cache past this many bounces
+	int trainEvery = 16;        // one subpixel path in this many is a full-length training path
+	int maxSteps = 32;          // Adam steps per pass
+	bool trained = false;
+	double lastLoss = 0;
+	static thread_local Mode mode;
+	static thread_local std::vector<Sample> *sink;
+
+private:
+	enum { Batch = 1024, Inputs = Width };
+
+	struct Activations {
+		alignas(32) float x[Inputs], h1[Width], h2[Width], y[Width];
+		int corner[Levels][8];
+		float weight[Levels][8];
+	};
+
+	static void store(float *dst, const Vec &v) { dst[0] = float(v.x); dst[1] = float(v.y); dst[2] = float(v.z); }
+
+	// the 8 table entries around x on level l and their trilinear weights
+	void corners(const Sample &s, int l, int *corner, float *weight) const {
+		const int res = resolution[l];
+		float p[3];
+		int c[3];
+		for (int a = 0; a < 3; a++) {
+			p[a] = std::min(1.0f, std::max(0.0f, float((s.x[a] - axis(lo, a)) * axis(invExtent, a)))) * res;
+			c[a] = std::min(res - 1, int(p[a]));
+			p[a] -= c[a];
+		}
+		const bool dense = (long long)(res + 1) * (res + 1) * (res + 1) <= Table;
+		for (int k = 0; k < 8; k++) {
+			unsigned x = c[0] + (k & 1), y = c[1] + (k >> 1 & 1), z = c[2] + (k >> 2);
+			unsigned index = dense ? x + (res + 1) * (y + (res + 1) * z) : (x ^ y * 2654435761u ^ z * 805459861u) & (Table - 1);
+			corner[k] = offTable + (l * Table + index) * Features;
+			weight[k] = (k & 1 ? p[0] : 1 - p[0]) * (k >> 1 & 1 ? p[1] : 1 - p[1]) * (k >> 2 ? p[2] : 1 - p[2]);
+		}
+	}
+
+	// y = W3 relu(W2 relu(W1 x + b1) + b2) + b3, weights stored [in][out]
+	static void layer(const float *in, int nin, const float *W, const float *b, float *out, bool relu) {
+		alignas(32) float acc[Width];
+		for (int o = 0; o < Width; o++) acc[o] = b[o];
+		for (int i = 0; i < nin; i++) {
+			const float xi = in[i], *row = W + i * Width;
+			for (int o = 0; o < Width; o++) acc[o] += row[o] * xi;
+		}
+		for (int o = 0; o < Width; o++) out[o] = relu ? std::max(0.0f, acc[o]) : acc[o];
+	}
+
+	void forward(const Sample &s, Activations &a) const {
+		for (int l = 0; l < Levels; l++) {
+			corners(s, l, a.corner[l], a.weight[l]);
+			for (int f = 0; f < Features; f++) {
+				float e = 0;
+				for (int k = 0; k < 8; k++) e += a.weight[l][k] * params[a.corner[l][k] + f];
+				a.x[l * Features + f] = e;
+			}
+		}
+		float *extra = a.x + Levels * Features;
+		for (int k = 0; k < 3; k++) { extra[k] = s.n[k]; extra[3 + k] = s.wo[k]; extra[6 + k] = s.albedo[k]; }
+		for (int k = Levels * Features + 9; k < Inputs; k++) a.x[k] = 0;
+		layer(a.x, Inputs, &params[offW1], &params[offB1], a.h1, true);
+		layer(a.h1, Width, &params[offW2], &params[offB2], a.h2, true);
+		layer(a.h2, Width, &params[offW3], &params[offB3], a.y, false);
+	}
+
+	// accumulates the gradient of one sample into g (laid out from offW1) and
+	// the gradient of its encoding into encodingGrad; returns its loss
+	double backward(const Sample &s, float *g, float *encodingGrad) const {
+		Activations a;
+		forward(s, a);
+		alignas(32) float dy[Width] = { 0 }, dh2[Width], dh1[Width];
+		double loss = 0;
+		for (int o = 0; o < Outputs; o++) {
+			float d = a.y[o] - s.target[o], norm = a.y[o] * a.y[o] + 0.01f;
+			loss += d * d / norm;
+			dy[o] = 2 * d / norm / (Batch * Outputs);
+		}
+		backLayer(a.h2, &params[offW3], dy, g + (offW3 - offW1), g + (offB3 - offW1), dh2, a.h2);
+		backLayer(a.h1, &params[offW2], dh2, g + (offW2 - offW1), g + (offB2 - offW1), dh1, a.h1);
+		alignas(32) float dx[Inputs];
+		backLayer(a.x, &params[offW1], dh1, g, g + (offB1 - offW1), dx, 0);
+		for (int k = 0; k < Levels * Features; k++) encodingGrad[k] = dx[k];
+		return loss;
+	}
+
+	// dout is the gradient at the layer output; din gets the gradient at its
+	// input, masked by the ReLU whose output was `active` (if any)
+	static void backLayer(const float *in, const float *W, const float *dout, float *gW, float *gb, float *din, const float *active) {
+		for (int o = 0; o < Width; o++) gb[o] += dout[o];
+		for (int i = 0; i < Width; i++) {
+			const float *row = W + i * Width;
+			float *grow = gW + i * Width, xi = in[i], sum = 0;
+			for (int o = 0; o < Width; o++) grow[o] += dout[o] * xi;
+			for (int o = 0; o < Width; o++) sum += row[o] * dout[o];
+			din[i] = active && active[i] <= 0 ? 0 : sum;
+		}
+	}
+
+	void scatterEncoding(const Sample &s, const float *encodingGrad, std::vector<float> &tableGrad) const {
+		int corner[8];
+		float weight[8];
+		for (int l = 0; l < Levels; l++) {
+			corners(s, l, corner, weight);
+			for (int k = 0; k < 8; k++)
+				for (int f = 0; f < Features; f++) tableGrad[corner[k] + f] += weight[k] * encodingGrad[l * Features + f];
+		}
+	}
+
+	// g[k - begin] is the gradient of params[k] for k in [begin, end)
+	void adam(const float *g, int begin, int end) {
+		const float lr = 5e-3f, b1 = 0.9f, b2 = 0.99f, eps = 1e-8f;
+		if (begin == offTable) t++;
+		const float c1 = 1 - pow(b1, t), c2 = 1 - pow(b2, t);
+		g -= begin;
+		for (int k = begin; k < end; k++) {
+			m[k] = b1 * m[k] + (1 - b1) * g[k];
+			v[k] = b2 * v[k] + (1 - b2) * g[k] * g[k];
+			params[k] -= lr * (m[k] / c1) / (sqrt(v[k] / c2) + eps);
+		}
+	}
+
+	int offTable, offW1, offB1, offW2, offB2, offW3, offB3;
+	int resolution[Levels];
+	std::vector<float> params, m, v;
+	int t = 0;
+	bool boundsSet = false;
+	Vec lo, invExtent;
+} radianceCache;
+
+thread_local NeuralRadianceCache::Mode NeuralRadianceCache::mode = NeuralRadianceCache::Off;
+thread_local std::vector<NeuralRadianceCache::Sample> *NeuralRadianceCache::sink = 0;
+
+
+/*
+* Global functions
+*/
+
+Vec radiance(const Ray &r, const Sphere &s, Vec xN, int depth, bool flag);
+Vec reflectedRadiance(const Ray &r, const Sphere &s, Vec xN, int depth, bool flag);
+Vec directRadiance(const Ray &r, const Sphere &s, const Sphere &lSource, Vec xN, int depth);
+Vec unshadowedDirectRadiance(const Ray &r, const Sphere &s, const Sphere &lSource, Vec xN, Ray &toLight, Ray &yNormal);
+Vec indirectRadiance1(const Ray &r, const Sphere &s, Vec xN, int depth);
+void luminaireSample(const Sphere &s, double time, Vec &i, Vec &ni, double &pdf);
+int visible(const Ray &r, const Ray &n);
+
+Vec indirectRadiance2(const Ray &r, const Sphere &s, Vec xN, int depth);
+Vec continuePath(const Ray &outgoing, const Sphere &obj, const Vec &n, int depth, bool isSpec);
+
+
+bool intersect(const Ray &r, Hit &hit) {
+	control.threads[TaskScheduler::workerId()].addRay();
+	hit = Hit();
+	const int numSpheres = int(spheres.size());
+	if (sphereBVH.linear) {
+		// the nearest hit is kept in locals: stores through hit could alias the
+		// spheres' doubles and force every centre to be reloaded
+		const Sphere *s = spheres.data();
+		double t = hit.t;
+		int id = -1;
+		if (!sphereBVH.motion) {
+			for (int i = 0; i < numSpheres; i++) {
+				double d = s[i].intersect(r, s[i].p);
+				if (d && d < t) { t = d; id = i; }
+			}
+		}
+		else {
+			// (moving spheres only come through here as the self-test's brute-force reference)
+			for (int i = 0; i < numSpheres; i++) {
+				double d = s[i].intersect(r);
+				if (d && d < t) { t = d; id = i; }
+			}
+		}
+		hit.t = t;
+		hit.id = id;
+	}
+	else {
+		const BVH &bvh = sphereBVH.at(r.time);
+		bvh.traverse(r, hit.t, [&](int start, int count, double &tmax) {
+			bool found = false;
+			for (int k = start; k < start + count; k++) {
+				double d = spheres[bvh.prims[k]].intersect(r);
+				if (d && d < tmax) { tmax = d; hit.id = bvh.prims[k]; found = true; }
+			}
+			return found;
+		});
+	}
+	for (size_t m = 0; m < meshes.size(); m++) if (meshes[m]->intersect(r, hit)) hit.id = numSpheres + int(m);
+	return hit.id >= 0;
+}
+
+// The shading point of a Hit. Attributes are computed on first use and kept,
+// so each bounce derives the position and normal once.
+struct Interaction {
+	Interaction(const Ray &r_, const Hit &hit_) : r(r_), hit(hit_) {}
+
+	// the sphere, or the BRDF/emission carrier of the mesh
+	const Sphere &surface() const {
+		const Sphere &s = hit.id < int(spheres.size()) ? spheres[hit.id] : meshes[hit.id - spheres.size()]->surface;
+		MaterialTable::touch(s.brdf);
+		return s;
+	}
+
+	const Vec &position() {
+		if (!has(Position)) x = r.o + r.d * hit.t;
+		return x;
+	}
+
+	// direction back along the ray (ray directions are unit length)
+	Vec wo() const { return Vec() - r.d; }
+
+	// geometric normal flipped to the side of wo
+	const Vec &normal() {
+		if (!has(Normal)) {
+			if (hit.id < int(spheres.size())) {
+				const Sphere &s = spheres[hit.id];
+				n = (position() - (sphereBVH.motion ? s.center(r.time) : s.p)) * s.invRad;
+			}
+			else n = meshes[hit.id - spheres.size()]->normal(hit.prim);
+			if (n.dot(r.d) > 0) n = n * -1.0;
+		}
+		return n;
+	}
+
+	// the ray leaving the surface towards the previous vertex, as the estimators expect
+	Ray outgoing() { return Ray(position(), wo(), r.time); }
+
+private:
+	enum { Position = 1, Normal = 2 };
+	bool has(int attribute) {
+		bool had = (computed & attribute) != 0;
+		computed |= attribute;
+		return had;
+	}
+
+	const Ray &r;
+	const Hit &hit;
+	int computed = 0;
+	Vec x, n;
+};
+
+
+/*
+* KEY FUNCTION: radiance estimator
+*/
+
+Vec receivedRadiance(const Ray &r, int depth, bool flag) {		// r has the current  position and the direction of the ray pointing to the previous x poistion
+	Hit hit;                                    // Distance, object and primitive hit
+
+	if (!intersect(r, hit)) return Vec();       // if miss, return black
+	Interaction it(r, hit);
+	const Sphere &obj = it.surface();           // the hit object
+	Vec n = it.normal();                        // The normal direction	//n at x
+
+	/*
+	Tips
+
+	1. Other useful quantities/variables:
+	Vec Le = obj.e;                             // Emitted radiance
+	const BRDF &brdf = obj.brdf;                // Surface BRDF at x
+
+	2. Call brdf.sample() to sample an incoming direction and continue the recursion
+	*/
+
+	Vec rad;
+	Ray outgoing = it.outgoing();               // at x, towards the previous vertex
+	bool isSpec = obj.brdf.isSpecular();
+
+	rad = radiance(outgoing, obj, n, depth, isSpec);
+
+	return rad;
+}
+
+//////////////////////////GENERAL RADIANCE FUNCTION
+Vec radiance(const Ray &r, const Sphere &s, Vec xN, int depth, bool flag) {
+	Vec rad;
+	rad = s.e + reflectedRadiance(r, s, xN, depth, flag);		//reflectedRadiance requires the sphere that was intersected with to operate to call directradiance
+	return rad;
+}
+
+
+/////////////////////////////REFLECTED RADIANCE FUNCTION
+Vec reflectedRadiance(const Ray &r, const Sphere &s, Vec xN, int depth, bool flag) {		// r has the current  position and the direction of the ray pointing to the previous x poistion
+	Vec rad;			// rad is the reflected radiance at this point
+	const Sphere &light = spheres[7];
+	if (flag && !Regularization::active()) {
+		rad = indirectRadiance2(r, s, xN, depth);
+	}
+	else {
+		// splitting: average several light and BRDF samples where the path was
+		// expensive to reach (the first, and optionally second, diffuse vertex)
+		bool split = depth == 1 || (depth == 2 && settings.splitSecondary);
+		int nLight = split ? settings.lightSplit : 1, nBRDF = split ? settings.brdfSplit : 1;
+		for (int k = 0; k < nLight; k++)
+			rad = rad + directRadiance(r, s, light, xN, depth) * (1.0 / nLight);
+		for (int k = 0; k < nBRDF; k++)
+			rad = rad + indirectRadiance1(r, s, xN, depth) * (1.0 / nBRDF);
+	}
+
+	return rad;
+}
+
+/////////////////////////////DIRECT RADIANCE 		//pass in the sphere to be used as the luminaired source (can access stuff like emitted radiance)
+//also pass in brdf of whatever sphere the ray "r" is originating from
+Vec directRadiance(const Ray &r, const Sphere &s, const Sphere &lSource, Vec xN, int depth) {
+	Ray toLight, yNormal;
+	Vec result = unshadowedDirectRadiance(r, s, lSource, xN, toLight, yNormal);
+	return result * visible(toLight, yNormal);
+}
+
+// directRadiance() before its visibility test, which is left to the caller:
+// toLight is the shadow ray and yNormal the light point with its normal
+Vec unshadowedDirectRadiance(const Ray &r, const Sphere &s, const Sphere &lSource, Vec xN, Ray &toLight, Ray &yNormal) {
+	Vec y, yN, dirRad;
+	double pdf, r2;
+	luminaireSample(lSource, r.time, y, yN, pdf);
+	dirRad = (y - r.o).normalize();
+	toLight = Ray(r.o, dirRad, r.time);
+	yNormal = Ray(y, yN, r.time);
+	r2 = (y - r.o).dot((y - r.o));
+	return ((lSource.e).mult(s.brdf.eval(xN, r.d, dirRad))) * xN.dot(dirRad) * yN.dot((Vec() - dirRad).normalize()) * (1.0 / (r2 * pdf));
+}
+
+////////////////////////////INDIRECT RADIANCE1	(must recursively call the reflectiveRadiance function)
+
+Vec indirectRadiance1(const Ray &r, const Sphere &s, Vec xN, int depth) {
+	Vec incDir, rad;
+	int rrDepth = settings.rrDepth;
+	float survivalProbability = settings.survivalProbability;
+	float p, randVal;
+	double probDF;
+
+	if (depth <= rrDepth) {
+		p = 1.0;
+	}
+	else {
+		p = survivalProbability;
+	}
+	randVal = rng();
+	if (randVal < p) {
+		s.brdf.sample(xN, r.d, incDir, probDF);
+		Ray xOut(r.o, incDir, r.time);
+		Hit hit;
+		if (!intersect(xOut, hit)) return Vec();   // if miss, return black
+		Interaction it(xOut, hit);
+		const Sphere &obj = it.surface();           // the hit object
+		Vec n = it.normal();                        // The normal direction	//n at x-1
+
+		bool isSpec = obj.brdf.isSpecular();		//checking to see if sphere that was collided is specular or not
+
+		Ray outgoing = it.outgoing();			//outgoing ray at position x (which is x-1)
+		rad = (continuePath(outgoing, obj, n, (depth + 1), isSpec)).mult(s.brdf.eval(xN, r.d, incDir)) * xN.dot(incDir) * (1.0 / (probDF * p));
+	}
+	else {
+		rad = Vec();
+	}
+
+	return rad;
+}
+
+////////////////////////////INDIRECT RADIANCE2	(must recursively call the radiance function)
+Vec indirectRadiance2(const Ray &r, const Sphere &s, Vec xN, int depth) {
+	Vec incDirR, rad;
+	int rrDepth = settings.rrDepth;
+	float survivalProbability = settings.survivalProbability;
+	float p, randVal;
+	double probDFR;
+									//double probDFS;
+
+	rad = Vec();
+
+	if (depth <= rrDepth) {
+		p = 1.0;
+	}
+	else {
+		p = survivalProbability;
+	}
+	randVal = rng();
+	if (randVal < p) {
+		s.brdf.sample(xN, r.d, incDirR, probDFR);
+		Ray xOutR(r.o, incDirR, r.time);
+
+		Hit hit;
+		if (!intersect(xOutR, hit)) return Vec();   // if miss, return black
+		Interaction it(xOutR, hit);
+		const Sphere &obj = it.surface();           // the hit object
+		Vec n = it.normal();                        // The normal direction	//n at x-1
+
+		bool isSpec = obj.brdf.isSpecular();		//checking to see if sphere that was collided is specular or not
+
+		Ray outgoing = it.outgoing();			//outgoing ray at position x (which is x-1)
+		rad = rad + (obj.e + continuePath(outgoing, obj, n, (depth + 1), isSpec)).mult(s.brdf.eval(xN, r.d, incDirR)) * xN.dot(incDirR) * (1.0 / p);
+	}
+
+	return rad;
+}
+
+// reflected radiance leaving a path vertex towards the previous one: traced,
+// or looked up in the radiance cache once the path is deep enough
+Vec continuePath(const Ray &outgoing, const Sphere &obj, const Vec &n, int depth, bool isSpec) {
+	if (radianceCache.terminates(depth, isSpec)) return radianceCache.query(outgoing.o, n, outgoing.d, obj.brdf.albedo());
+	Vec reflected = reflectedRadiance(outgoing, obj, n, depth, isSpec);
+	if (NeuralRadianceCache::recording() && !isSpec) radianceCache.record(outgoing.o, n, outgoing.d, obj.brdf.albedo(), reflected);
+	return reflected;
+}
 
-	Vec rad;
-	Ray outgoing(x, o);
-	bool isSpec = obj.brdf.isSpecular();
 
-	rad = radiance(outgoing, obj, n, depth, isSpec);
+////////////LUMINAIRE SAMPLE FUNCTION
+
+void luminaireSample(const Sphere &s, double time, Vec &i, Vec &ni, double &pdf) {		//LUMINARE SAMPLE IMPLEMENTATION (returns a point "i", normal to "i" called "ni", and a pdf.
+	float rand1, rand2, z, x, y;
+	rand1 = rng();
+	rand2 = rng();
+	z = (2.0 * rand1) - 1.0;
+	x = sqrt(1 - (pow(z, 2.0))) * cos(2.0 * PI * rand2);
+	y = sqrt(1 - (pow(z, 2.0))) * sin(2.0 * PI * rand2);
+
+	ni = Vec(x, y, z);
+	i = s.center(time) + ni * s.rad;
+	pdf = (1.0 / (4.0 * PI * pow(s.rad, 2.0)));
+}
+
+
+/*
+* Shadow cache: each worker remembers, per light, the object that last blocked
+* a shadow ray towards it and tests that one object before traversing the
+* scene. Neighbouring shading points are mostly shadowed by the same thing,
+* so one sphere or triangle test often replaces a full traversal. Anything
+* hit before the sampled light point means the light point is not visible,
+* so a cache hit gives exactly the traversal's answer.
+*/
+
+struct ShadowCache {
+	struct Occluder { int id = -1, prim = 0; };
+	struct alignas(64) Slot { std::vector<Occluder> byLight; };
+
+	void init(int nworkers) { slots.assign(nworkers, Slot()); }
+
+	Occluder &at(int light) {
+		std::vector<Occluder> &v = slots[TaskScheduler::workerId()].byLight;
+		if (light >= int(v.size())) v.resize(light + 1);
+		return v[light];
+	}
+
+	// whether the cached occluder blocks r before distance tmax
+	static bool blocks(const Occluder &c, const Ray &r, double tmax) {
+		if (c.id < 0) return false;
+		int numSpheres = int(spheres.size());
+		double d = c.id < numSpheres ? spheres[c.id].intersect(r) : meshes[c.id - numSpheres]->intersectPrim(r, c.prim);
+		return d && d < tmax;
+	}
+
+	static long long total(std::atomic<long long> ThreadStats::*counter) {
+		long long n = 0;
+		for (int i = 0; i < control.nthreads; i++) n += (control.threads[i].*counter).load();
+		return n;
+	}
+
+	long long rays() const { return total(&ThreadStats::shadowRays); }
+	long long hits() const { return total(&ThreadStats::shadowCacheHits); }
+
+	void report() const {
+		long long n = rays(), farSide = total(&ThreadStats::shadowFarSide), blocked = hits() + total(&ThreadStats::shadowBlocked);
+		if (!enabled || !n) return;
+		fprintf(stderr, "Shadow cache: %lld shadow rays, %.1f%% towards the light's far side, %.1f%% answered by the last occluder "
+			"(%.1f%% of those blocked by other objects)\n", n, 100.0 * farSide / n, 100.0 * hits() / n, blocked ? 100.0 * hits() / blocked : 0.0);
+	}
+
+	bool enabled = false;       // --shadow-cache; pays off only where one object shadows large areas
+	std::vector<Slot> slots;
+} shadowCache;
+
+// Visibility function
+
+int visible(const Ray &r, const Ray &n) {
+	const int lightId = 7;
+	ThreadStats &ts = control.threads[TaskScheduler::workerId()];
+	ThreadStats::add(ts.shadowRays);
+	// the light itself hides points on its far side; the traversal below would
+	// only find that after testing everything in front of it
+	Vec fromLight = (Vec() - r.d).normalize();
+	if (!(fromLight.dot(n.d) > 0)) {
+		ThreadStats::add(ts.shadowFarSide);
+		return 0;
+	}
+	ShadowCache::Occluder *cached = 0;
+	if (shadowCache.enabled) {
+		cached = &shadowCache.at(lightId);
+		Vec toLight = n.o - r.o;
+		if (ShadowCache::blocks(*cached, r, sqrt(toLight.dot(toLight)) * (1 - 1e-6))) {
+			ThreadStats::add(ts.shadowCacheHits);
+			return 0;
+		}
+	}
+	Hit hit;                                    // Distance and id of intersected sphere
+	if (!intersect(r, hit)) return 0;
+	if (hit.id == lightId) return 1;            // the far side was ruled out above
+	if (cached) {
+		cached->id = hit.id;
+		cached->prim = hit.prim;
+		ThreadStats::add(ts.shadowBlocked);
+	}
+	return 0;
+}
+
+/*
+* Shadow ray packets: visible() for a batch of shadow rays at once. Rays
+* towards the light's far side or answered by the shadow cache drop out; the rest are
+* traced in packets of up to RayPacket::Size through the sphere BVH and the
+* meshes. A ray is visible if nothing is hit before the light is, which is
+* visible()'s answer for a point on the near side.
+* The rays of a tile's pixel stay close enough for one box test to take the
+* whole packet through most nodes, which pays off once there are enough
+* spheres for the BVH; the few spheres of the built-in scene are tested
+* faster one ray at a time by intersect()'s loop.
+*/
+
+struct ShadowPackets {
+	// vis[k] = visible(toLight[k], yNormal[k]) for k < n
+	void trace(const Ray *toLight, const Ray *yNormal, int n, int *vis) {
+		ThreadStats &ts = control.threads[TaskScheduler::workerId()];
+		// a packet shares one sphere BVH, so moving scenes group rays by time segment first
+		std::vector<int> order;
+		if (sphereBVH.motion) {
+			order.resize(n);
+			for (int k = 0; k < n; k++) order[k] = k;
+			std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+				return &sphereBVH.at(toLight[a].time) < &sphereBVH.at(toLight[b].time);
+			});
+		}
+		RayPacket p;
+		int slot[RayPacket::Size];
+		Stats stats;
+		for (int j = 0; j < n; j++) {
+			int k = order.empty() ? j : order[j];
+			vis[k] = 0;
+			ThreadStats::add(ts.shadowRays);
+			Vec fromLight = (Vec() - toLight[k].d).normalize();
+			if (!(fromLight.dot(yNormal[k].d) > 0)) {
+				ThreadStats::add(ts.shadowFarSide);
+				continue;
+			}
+			// the cache is checked as the packet fills, so it sees the previous packets' blockers
+			if (shadowCache.enabled) {
+				Vec d = yNormal[k].o - toLight[k].o;
+				if (ShadowCache::blocks(shadowCache.at(LightId), toLight[k], sqrt(d.dot(d)) * (1 - 1e-6))) {
+					ThreadStats::add(ts.shadowCacheHits);
+					continue;
+				}
+			}
+			// visible() asks whether the light is the closest hit, so the packet
+			// looks for anything short of the light's own hit; a grazing ray
+			// missing the light is shadowed
+			double tLight = spheres[LightId].intersect(toLight[k]);
+			if (!tLight) continue;
+			if (p.count && sphereBVH.motion && &sphereBVH.at(p.rays[0].time) != &sphereBVH.at(toLight[k].time)) flush(p, slot, vis, stats);
+			slot[p.count] = k;
+			p.add(toLight[k], tLight);
+			if (p.count == RayPacket::Size) flush(p, slot, vis, stats);
+		}
+		if (p.count) flush(p, slot, vis, stats);
+		totalPackets += stats.packets;
+		totalRays += stats.rays;
+		nodeVisits += stats.visits;
+		nodesCulled += stats.culled;
+	}
+
+	struct Stats { long long packets = 0, rays = 0, visits = 0, culled = 0; };
+
+	// traces p, writes vis[slot[k]] for its rays and empties it
+	void flush(RayPacket &p, const int *slot, int *vis, Stats &stats) {
+		ThreadStats &ts = control.threads[TaskScheduler::workerId()];
+		const BVH &bvh = sphereBVH.at(p.rays[0].time);
+		int blocker[RayPacket::Size], prim[RayPacket::Size];
+		p.finalize();
+		unsigned live = (1u << p.count) - 1;
+		std::pair<int, int> visits = bvh.traversePacket(p, live, [&](int start, int count, unsigned active, unsigned &alive) {
+			for (int j = start; j < start + count; j++) {
+				int id = bvh.prims[j];
+				if (id == LightId) continue;
+				for (int g = 0; g < RayPacket::Groups; g++) {
+					unsigned lanes = RayPacket::group(active & alive, g);
+					if (!lanes) continue;
+					for (unsigned m = lanes & p.blockedBy(spheres[id], g); m; m &= m - 1) {
+						int k = g * RayPacket::Width + __builtin_ctz(m);
+						alive &= ~(1u << k);
+						blocker[k] = id;
+						prim[k] = 0;
+					}
+				}
+			}
+		});
+		const int numSpheres = int(spheres.size());
+		for (size_t m = 0; m < meshes.size() && live; m++) {
+			unsigned before = live;
+			meshes[m]->occlude(p, live, prim);
+			for (int k = 0; k < p.count; k++)
+				if ((before & ~live) >> k & 1) blocker[k] = numSpheres + int(m);
+		}
+		for (int k = 0; k < p.count; k++) {
+			if (live >> k & 1) {
+				vis[slot[k]] = 1;
+				continue;
+			}
+			ThreadStats::add(ts.shadowBlocked);
+			if (shadowCache.enabled && prim[k] >= 0) {
+				ShadowCache::Occluder &c = shadowCache.at(LightId);
+				c.id = blocker[k];
+				c.prim = prim[k];
+			}
+		}
+		stats.packets++;
+		stats.rays += p.count;
+		stats.visits += visits.first;
+		stats.culled += visits.second;
+		p.count = 0;
+	}
+
+	void report() const {
+		if (!totalPackets) return;
+		fprintf(stderr, "Shadow packets: %lld packets of %.1f rays, %.1f%% of %lld node visits rejected for the whole packet\n",
+			totalPackets.load(), double(totalRays) / totalPackets, nodeVisits ? 100.0 * nodesCulled / nodeVisits : 0.0, nodeVisits.load());
+	}
+
+	static const int LightId = 7;
+	// for --integrator direct; --no-shadow-packets traces rays one by one
+	bool used() const { return enabled && !sphereBVH.linear; }
+
+	bool enabled = true;
+	std::atomic<long long> totalPackets{0}, totalRays{0}, nodeVisits{0}, nodesCulled{0};
+} shadowPackets;
+
+
+/*
+* Spectral mode (--spectral): every camera path carries four wavelengths in one
+* SIMD register, a uniformly sampled hero and three companions rotated by a
+* quarter of the range, so one path yields four stratified spectral samples.
+* Directions in this scene do not depend on wavelength, so the hero's path is
+* valid for all four lanes unchanged and only reflectance and emission are
+* evaluated per lane. RGB scene colours are upsampled to smooth spectra on a
+* basis of three Gaussians chosen to round-trip through the film's colour
+* matching (exactly for colours inside the basis gamut, see upsample()), and the film converts through CIE XYZ to linear sRGB,
+* white balanced so a flat unit spectrum maps to (1, 1, 1).
+*/
+
+typedef float Spectrum4 __attribute__((vector_size(16)));   // one lane per wavelength
+
+struct SpectralRenderer {
+	enum { Lanes = 4 };
+	static constexpr double LambdaMin = 380, LambdaMax = 720;
+
+	// multi-lobe piecewise Gaussian fit of the CIE 1931 observer (Wyman et al. 2013)
+	static double lobe(double l, double mu, double s1, double s2) {
+		double t = (l - mu) / (l < mu ? s1 : s2);
+		return exp(-0.5 * t * t);
+	}
+
+	static Vec cieXYZ(double l) {
+		return Vec(1.056 * lobe(l, 599.8, 37.9, 31.0) + 0.362 * lobe(l, 442.0, 16.0, 26.7) - 0.065 * lobe(l, 501.1, 20.4, 26.2),
+			0.821 * lobe(l, 568.8, 46.9, 40.5) + 0.286 * lobe(l, 530.9, 16.3, 31.1),
+			1.217 * lobe(l, 437.0, 11.8, 36.0) + 0.681 * lobe(l, 459.0, 26.0, 13.8));
+	}
+
+	// linear sRGB matching functions, unit area per channel (the white balance)
+	Vec matching(double l) const {
+		Vec c = cieXYZ(l);
+		Vec rgb(3.2406 * c.x - 1.5372 * c.y - 0.4986 * c.z,
+			-0.9689 * c.x + 1.8758 * c.y + 0.0415 * c.z,
+			0.0557 * c.x - 0.2040 * c.y + 1.0570 * c.z);
+		return rgb.mult(whiteScale);
+	}
+
+	static double basis(int j, double l) {
+		static const double mu[3] = { 610, 545, 460 }, sigma[3] = { 50, 45, 40 };
+		double t = (l - mu[j]) / sigma[j];
+		return exp(-0.5 * t * t);
+	}
+
+	void init() {
+		const double step = 0.5;
+		Vec area;
+		whiteScale = Vec(1, 1, 1);
+		for (double l = LambdaMin + step / 2; l < LambdaMax; l += step) area = area + matching(l) * step;
+		whiteScale = Vec(1 / area.x, 1 / area.y, 1 / area.z);
+		// film response to each basis spectrum, inverted so upsample() round-trips
+		double A[3][3] = {};
+		for (double l = LambdaMin + step / 2; l < LambdaMax; l += step) {
+			Vec c = matching(l);
+			for (int j = 0; j < 3; j++) {
+				double b = basis(j, l) * step;
+				A[0][j] += c.x * b; A[1][j] += c.y * b; A[2][j] += c.z * b;
+			}
+		}
+		double det = A[0][0] * (A[1][1] * A[2][2] - A[1][2] * A[2][1]) - A[0][1] * (A[1][0] * A[2][2] - A[1][2] * A[2][0]) +
+			A[0][2] * (A[1][0] * A[2][1] - A[1][1] * A[2][0]);
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++) {
+				int i1 = (j + 1) % 3, i2 = (j + 2) % 3, j1 = (i + 1) % 3, j2 = (i + 2) % 3;
+				inverse[i][j] = (A[i1][j1] * A[i2][j2] - A[i1][j2] * A[i2][j1]) / det;
+			}
+	}
+
+	// per-path wavelength state: basis and matching function values in each lane
+	struct Wavelengths {
+		Spectrum4 basis[3], matching[3];
+	};
+
+	void sample(Wavelengths &w) const {
+		double range = LambdaMax - LambdaMin, hero = rng() * range;
+		for (int k = 0; k < Lanes; k++) {
+			double l = LambdaMin + fmod(hero + k * range / Lanes, range);
+			Vec c = matching(l);
+			for (int j = 0; j < 3; j++) w.basis[j][k] = float(basis(j, l));
+			w.matching[0][k] = float(c.x); w.matching[1][k] = float(c.y); w.matching[2][k] = float(c.z);
+		}
+	}
+
+	// smooth non-negative spectrum whose film response is rgb. Saturated colours
+	// outside the basis gamut need a negative weight somewhere; clamping the
+	// spectrum at zero keeps it physical but shifts their response off rgb
+	Spectrum4 upsample(const Wavelengths &w, const Vec &rgb) const {
+		Spectrum4 s = w.basis[0] * float(inverse[0][0] * rgb.x + inverse[0][1] * rgb.y + inverse[0][2] * rgb.z) +
+			w.basis[1] * float(inverse[1][0] * rgb.x + inverse[1][1] * rgb.y + inverse[1][2] * rgb.z) +
+			w.basis[2] * float(inverse[2][0] * rgb.x + inverse[2][1] * rgb.y + inverse[2][2] * rgb.z);
+		Spectrum4 zero = {};
+		return s > zero ? s : zero;
+	}
+
+	// film response of one path's four lanes; each lane is uniform over the range
+	Vec toRGB(const Wavelengths &w, const Spectrum4 &L) const {
+		float scale = float((LambdaMax - LambdaMin) / Lanes);
+		Spectrum4 r = L * w.matching[0], g = L * w.matching[1], b = L * w.matching[2];
+		return Vec(r[0] + r[1] + r[2] + r[3], g[0] + g[1] + g[2] + g[3], b[0] + b[1] + b[2] + b[3]) * scale;
+	}
+
+	// the path tracer of receivedRadiance() with spectral throughput: a light
+	// sample at diffuse vertices, emission where it was reached by the camera
+	// or a mirror, russian roulette after settings.rrDepth
+	Vec radiance(Ray r) const {
+		Wavelengths w;
+		sample(w);
+		const Sphere &light = spheres[7];
+		Spectrum4 L = {}, beta = { 1, 1, 1, 1 };
+		bool countEmission = true;
+		for (int depth = 1;; depth++) {
+			Hit hit;
+			if (!intersect(r, hit)) break;
+			Interaction it(r, hit);
+			const Sphere &obj = it.surface();
+			Vec n = it.normal();
+			Ray outgoing = it.outgoing();
+			if (countEmission) L += beta * upsample(w, obj.e);
+			bool isSpec = obj.brdf.isSpecular();
+			if (!isSpec) {
+				Vec y, yN;
+				double pdf;
+				luminaireSample(light, r.time, y, yN, pdf);
+				Vec toY = y - outgoing.o, dir = toY;
+				dir.normalize();
+				double r2 = toY.dot(toY), cosX = n.dot(dir), cosY = -yN.dot(dir);
+				if (cosX > 0 && cosY > 0 && visible(Ray(outgoing.o, dir, r.time), Ray(y, yN, r.time))) {
+					Vec f = obj.brdf.eval(n, outgoing.d, dir) * (cosX * cosY / (r2 * pdf));
+					L += beta * upsample(w, f) * upsample(w, light.e);
+				}
+			}
+			float p = depth <= settings.rrDepth ? 1.0f : settings.survivalProbability;
+			if (rng() >= p) break;
+			Vec dir;
+			double pdf;
+			obj.brdf.sample(n, outgoing.d, dir, pdf);
+			Vec f = obj.brdf.eval(n, outgoing.d, dir) * (n.dot(dir) / pdf);
+			beta *= upsample(w, f) * (1.0f / p);
+			countEmission = isSpec;
+			r = Ray(outgoing.o, dir, r.time);
+		}
+		return toRGB(w, L);
+	}
+
+	bool enabled = false;
+	Vec whiteScale = Vec(1, 1, 1);
+	double inverse[3][3] = {};
+} spectral;
+
+
+/*
+* Preview integrators: cheaper estimators for layout and camera work, selected
+* with --integrator and run through the same scene, sampler and scheduler
+*/
+
+struct PreviewIntegrator {
+	enum Mode { Path, Direct, AmbientOcclusion, Albedo, Normal };
+
+	bool parse(const char *name) {
+		static const char *names[] = { "path", "direct", "ao", "albedo", "normal" };
+		for (int k = 0; k < 5; k++) if (!strcmp(name, names[k])) { mode = Mode(k); return true; }
+		return false;
+	}
+
+	Mode mode = Path;
+	double aoRadius = 20;   // occluders further away than this do not darken
+} integrator;
+
+// directLighting() up to its shadow ray, so that a tile's can be traced together
+struct DirectSample {
+	Vec throughput, emitted, unshadowed;
+	Ray toLight, yNormal;
+
+	Vec value(int visible) const { return throughput.mult(emitted + unshadowed * visible); }
+};
+
+// false if the camera path escapes or stays on mirrors
+bool directLightingSample(Ray r, DirectSample &ds) {
+	Vec throughput(1, 1, 1);
+	for (int bounce = 0; bounce < 8; bounce++) {
+		Hit hit;
+		if (!intersect(r, hit)) return false;
+		Interaction it(r, hit);
+		const Sphere &obj = it.surface();
+		Vec n = it.normal();
+		Ray outgoing = it.outgoing();
+		if (!obj.brdf.isSpecular()) {
+			ds.throughput = throughput;
+			ds.emitted = obj.e;
+			ds.unshadowed = unshadowedDirectRadiance(outgoing, obj, spheres[7], n, ds.toLight, ds.yNormal);
+			return true;
+		}
+		Vec dir;
+		double pdf;
+		obj.brdf.sample(n, outgoing.d, dir, pdf);
+		throughput = throughput.mult(obj.brdf.albedo());
+		r = Ray(outgoing.o, dir, r.time);
+	}
+	return false;
+}
+
+// emission plus one light sample at the first diffuse hit; mirror chains are
+// followed so that reflections of lit surfaces still show up
+Vec directLighting(Ray r) {
+	DirectSample ds;
+	if (!directLightingSample(r, ds)) return Vec();
+	return ds.value(visible(ds.toLight, ds.yNormal));
+}
+
+// directLighting() for a stream of camera rays with the shadow rays traced as
+// packets, a few packets' worth at a time so the pending samples stay in cache
+struct DirectBatch {
+	enum { Size = 4 * RayPacket::Size };
+
+	// result is written by the time flush() returns and must stay put until then
+	void add(const Ray &r, Vec &result) {
+		result = Vec();
+		if (!directLightingSample(r, samples[n])) return;
+		toLight[n] = samples[n].toLight;
+		yNormal[n] = samples[n].yNormal;
+		results[n] = &result;
+		if (++n == Size) flush();
+	}
+
+	void flush() {
+		shadowPackets.trace(toLight, yNormal, n, vis);
+		for (int k = 0; k < n; k++) *results[k] = samples[k].value(vis[k]);
+		n = 0;
+	}
+
+	DirectSample samples[Size];
+	Ray toLight[Size], yNormal[Size];
+	int vis[Size];
+	Vec *results[Size];
+	int n = 0;
+};
+
+// fraction of a cosine-weighted hemisphere unoccluded within aoRadius
+Vec ambientOcclusion(const Ray &r) {
+	static const DiffuseBRDF cosineLobe(Vec(1, 1, 1));
+	Hit hit;
+	if (!intersect(r, hit)) return Vec();
+	Interaction it(r, hit);
+	Vec n = it.normal(), dir;
+	double pdf;
+	cosineLobe.sample(n, it.wo(), dir, pdf);
+	Hit occluder;
+	bool occluded = intersect(Ray(it.position(), dir, r.time), occluder) && occluder.t < integrator.aoRadius;
+	return occluded ? Vec() : Vec(1, 1, 1);
+}
+
+// radiance (or AOV value) arriving along a camera ray under the selected integrator
+Vec estimate(const Ray &r) {
+	if (integrator.mode == PreviewIntegrator::Path) return spectral.enabled ? spectral.radiance(r) : receivedRadiance(r, 1, true);
+	if (integrator.mode == PreviewIntegrator::Direct) return directLighting(r);
+	if (integrator.mode == PreviewIntegrator::AmbientOcclusion) return ambientOcclusion(r);
+	Hit hit;
+	if (!intersect(r, hit)) return Vec();
+	Interaction it(r, hit);
+	if (integrator.mode == PreviewIntegrator::Albedo) return it.surface().brdf.albedo();
+	return it.normal() * 0.5 + Vec(0.5, 0.5, 0.5);     // facing normal mapped to [0, 1]
+}
+
+
+/*
+* Metrics socket: a local Unix domain socket serving one JSON object per
+* command line. Commands: "metrics" (or an empty line), "pause", "resume",
+* "stop" (stop tracing and write the image) and "budget <seconds>".
+*/
+
+long peakMemoryKB() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;		// kilobytes on Linux
+}
+
+std::string metricsJson() {
+	char buf[512];
+	std::string json;
+	double t = control.renderTime(), progress = control.progress();
+	long long rays = 0;
+	for (int i = 0; i < control.nthreads; i++) rays += control.threads[i].rays.load();
+	const char *state = control.finished ? "done" : control.stopRequested ? "stopping" : control.paused ? "paused" : "rendering";
+
+	snprintf(buf, sizeof(buf), "{\"state\":\"%s\",\"progress\":%.6f,\"elapsed\":%.3f,\"eta\":%.3f,\"budget\":%.3f,"
+		"\"rays\":%lld,\"rays_per_sec\":%.1f,\"spp_target\":%d,\"spp_reached\":%d,\"passes_done\":%d,\"passes_total\":%d,"
+		"\"memory_kb\":%ld,\"shadow_rays\":%lld,\"shadow_cache_hits\":%lld,\"threads\":[",
+		state, progress, t, progress > 0 ? t * (1.0 - progress) / progress : -1.0, control.budget.load(),
+		rays, t > 0 ? rays / t : 0.0, control.samps * 4, std::min(control.passesDone * control.sampsPerPass, control.samps.load()) * 4,
+		control.passesDone.load(), control.totalPasses.load(), peakMemoryKB(), shadowCache.rays(), shadowCache.hits());
+	json = buf;
+	for (int i = 0; i < control.nthreads; i++) {
+		snprintf(buf, sizeof(buf), "%s{\"rays\":%lld,\"utilization\":%.4f}", i ? "," : "",
+			control.threads[i].rays.load(), t > 0 ? std::min(1.0, control.threads[i].busy.load() / t) : 0.0);
+		json += buf;
+	}
+	return json + "]}";
+}
+
+std::string handleCommand(const std::string &line) {
+	char cmd[32] = "";
+	double value;
+	sscanf(line.c_str(), "%31s", cmd);
+
+	if (!cmd[0] || !strcmp(cmd, "metrics")) return metricsJson();
+	if (!strcmp(cmd, "pause")) control.pause();
+	else if (!strcmp(cmd, "resume")) control.resume();
+	else if (!strcmp(cmd, "stop")) control.stopRequested = true;
+	else if (!strcmp(cmd, "budget") && sscanf(line.c_str(), "%*s %lf", &value) == 1) control.budget = value;
+	else return "{\"ok\":false,\"error\":\"unknown command\"}";
+	return "{\"ok\":true}";
+}
+
+struct MetricsServer {
+	bool start(const char *socketPath) {
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(socketPath) >= sizeof(addr.sun_path)) return false;
+		strcpy(addr.sun_path, socketPath);
+
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) return false;
+		unlink(socketPath);
+		if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+			close(fd);
+			fd = -1;
+			return false;
+		}
+		path = socketPath;
+		running = true;
+		worker = std::thread(&MetricsServer::serve, this);
+		return true;
+	}
+
+	void stop() {
+		if (fd < 0) return;
+		running = false;
+		worker.join();
+		close(fd);
+		unlink(path.c_str());
+		fd = -1;
+	}
+
+	// accepts one client at a time; polls so that stop() is honoured promptly
+	void serve() {
+		while (running) {
+			pollfd pfd = { fd, POLLIN, 0 };
+			if (poll(&pfd, 1, 100) <= 0) continue;
+			int client = accept(fd, 0, 0);
+			if (client < 0) continue;
+			std::string pending;
+			char buf[256];
+			while (running) {
+				pollfd cfd = { client, POLLIN, 0 };
+				if (poll(&cfd, 1, 100) <= 0) continue;
+				ssize_t n = read(client, buf, sizeof(buf));
+				if (n <= 0) break;
+				pending.append(buf, n);
+				size_t eol;
+				while ((eol = pending.find('\n')) != std::string::npos) {
+					std::string reply = handleCommand(pending.substr(0, eol)) + "\n";
+					pending.erase(0, eol + 1);
+					if (write(client, reply.data(), reply.size()) < 0) break;
+				}
+			}
+			close(client);
+		}
+	}
+
+	int fd = -1;
+	std::string path;
+	std::atomic<bool> running{false};
+	std::thread worker;
+} metricsServer;
+
+
+/*
+* Main function
+*
+* Usage: simplept [spp] [--spp-per-pass N] [--tile N] [--threads N]
+*                 [--budget SECONDS] [--socket PATH] [--profile PATH] [--calibrate]
+*                 [--selftest] [--verbose]
+*                 [--preview] [--sample-parallel] [--size WxH] [--bench-splat]
+*                 [--blue-noise] [--split-light N] [--split-brdf M] [--split-secondary]
+*                 [--regularize] [--regularize-angle RADIANS] [--mom K]
+*                 [--mesh OBJ] [--mesh-scale S] [--mesh-offset X,Y,Z]
+*                 [--no-spatial-splits] [--split-budget F] [--shadow-cache] [--no-shadow-packets]
+*                 [--subdiv OBJ] [--subdiv-level N] [--displace AMPLITUDE]
+*                 [--displace-freq F] [--tess-cache MB] [--quantize 16|21]
+*                 [--move ID DX,DY,DZ] [--particles N] [--particle-speed S]
+*                 [--swept-bounds] [--time-segments K]
+*                 [--integrator path|direct|ao|albedo|normal] [--ao-radius R] [--spectral]
+*                 [--psf] [--psf-radius R] [--psf-normal COS] [--light-tracing]
+*                 [--nrc] [--nrc-depth D] [--nrc-train-every N] [--nrc-steps N]
+*                 [--frames N] [--camera-move DX,DY,DZ] [--temporal] [--history FRAMES]
+*                 [--upsample F] [--state FILE] [--edit MATERIAL R,G,B]
+* Samples are traced in passes over square tiles so that a render can be
+* paused, stopped or cut short by its time budget and still write a
+* consistent image. A tile of the next pass only waits for the same tile of
+* the previous one, and each band of output rows is encoded as soon as its
+* last tiles finish.
+*
+* --mom K replaces the clamped mean with a median of K bucket means of the
+* unclamped samples (progressive and preview renders).
+*
+* --preview traces every 4th pixel in x and y first, then the rest of every
+* 2nd, then the remaining pixels, rewriting image.ppm after each stage.
+*/
+
+// sample-weighted radiance sums and sample counts (per subpixel) of each pixel;
+// optionally also the moments of each clamped subpixel estimate's luminance,
+// and K buckets of unclamped samples for median-of-means estimation
+struct Accumulator {
+	Accumulator(int w_, int h_, bool moments = false, int buckets = 0) : w(w_), h(h_), c(w_*h_), samps(w_*h_), sub(4 * w_*h_) {
+		if (moments) { lum.resize(w*h); lum2.resize(w*h); count.resize(w*h); }
+		nbuckets = buckets;
+		if (nbuckets) { bucketSum.resize(w*h*nbuckets); bucketCount.resize(w*h*nbuckets); }
+	}
+
+	Vec value(int i) const {
+		if (nbuckets) return medianOfMeans(i);
+		return samps[i] ? c[i] * (1.0 / samps[i]) : Vec();
+	}
+
+	// c[i] from the unclamped subpixel sums: each subpixel's mean over all its
+	// samples is clamped once, so passes of any size give the same estimator
+	void resolve(int i) {
+		Vec v;
+		for (int k = 0; samps[i] && k < 4; k++) v = v + clamp(sub[4 * i + k] * (1.0 / samps[i]))*.25;
+		c[i] = v * samps[i];
+	}
+
+	void addSample(int i, int bucket, const Vec &v) {
+		bucketSum[i * nbuckets + bucket] = bucketSum[i * nbuckets + bucket] + v;
+		bucketCount[i * nbuckets + bucket]++;
+	}
+
+	// per channel median of the bucket means: a handful of rare, very bright
+	// samples can only move the buckets they landed in, not the median
+	Vec medianOfMeans(int i) const {
+		double m[3][32];
+		int n = 0;
+		for (int b = 0; b < nbuckets; b++) {
+			int k = bucketCount[i * nbuckets + b];
+			if (!k) continue;
+			const Vec &sum = bucketSum[i * nbuckets + b];
+			m[0][n] = sum.x / k; m[1][n] = sum.y / k; m[2][n] = sum.z / k;
+			n++;
+		}
+		if (!n) return Vec();
+		double med[3];
+		for (int ch = 0; ch < 3; ch++) {
+			std::sort(m[ch], m[ch] + n);
+			med[ch] = n % 2 ? m[ch][n / 2] : 0.5 * (m[ch][n / 2 - 1] + m[ch][n / 2]);
+		}
+		return Vec(med[0], med[1], med[2]);
+	}
+
+	// mean over the image of the estimated variance of each pixel's mean
+	double meanVariance() const {
+		double v = 0;
+		for (int i = 0; i < w*h; i++) {
+			if (count[i] < 2) continue;
+			double m = lum[i] / count[i];
+			v += std::max(0.0, lum2[i] / count[i] - m*m) / (count[i] - 1);
+		}
+		return v / (w*h);
+	}
+
+	int w, h;
+	std::vector<Vec> c;
+	std::vector<int> samps;
+	std::vector<Vec> sub;                       // unclamped radiance sums per subpixel, 4 per pixel
+	std::vector<double> lum, lum2;
+	std::vector<int> count;
+	std::vector<unsigned long long> materials;  // per pixel, the materials its paths touched (--state)
+	int nbuckets;
+	std::vector<Vec> bucketSum;
+	std::vector<int> bucketCount;
+};
+
+/*
+* Splatting film for integrators that write to arbitrary pixels (light
+* tracing, t=1 connections, photon splats). Each worker owns a table of
+* lazily allocated tiles, so splat() needs no atomics or locks; merge() runs
+* at pass boundaries with one task per tile summing that tile over all
+* workers, so merging needs no locks either. Small images simply preallocate
+* every tile, which amounts to a private full buffer per worker.
+*/
+
+struct SplatFilm {
+	SplatFilm(int w_, int h_, int nworkers_, int tile_ = 32) : w(w_), h(h_), tile(tile_), nworkers(nworkers_) {
+		tilesX = (w + tile - 1) / tile;
+		ntiles = tilesX * ((h + tile - 1) / tile);
+		tiles.resize(nworkers);
+		bool dense = 12LL * w * h * nworkers <= (64LL << 20);
+		for (int k = 0; k < nworkers; k++) {
+			tiles[k].resize(ntiles);
+			for (int t = 0; dense && t < ntiles; t++) tiles[k][t] = newTile();
+		}
+	}
+
+	// adds v to pixel (x, y), y counted from the bottom as in renderTile
+	void splat(int x, int y, const Vec &v) {
+		std::unique_ptr<float[]> &t = tiles[TaskScheduler::workerId()][(y / tile) * tilesX + x / tile];
+		if (!t) t = newTile();
+		float *p = &t[3 * ((y % tile) * tile + x % tile)];
+		p[0] += float(v.x); p[1] += float(v.y); p[2] += float(v.z);
+	}
+
+	// adds everything splatted so far into dst (indexed like Accumulator::c) and clears it;
+	// must not run concurrently with splat()
+	void merge(std::vector<Vec> &dst) {
+		scheduler.parallelFor(0, ntiles, 1, [&](int begin, int end) {
+			for (int t = begin; t < end; t++) {
+				const int x0 = (t % tilesX) * tile, y0 = (t / tilesX) * tile;
+				for (int k = 0; k < nworkers; k++) {
+					float *p = tiles[k][t].get();
+					if (!p) continue;
+					for (int y = y0; y < std::min(y0 + tile, h); y++) {
+						for (int x = x0; x < std::min(x0 + tile, w); x++) {
+							float *q = p + 3 * ((y - y0) * tile + x - x0);
+							Vec &c = dst[(h - y - 1)*w + x];
+							c = c + Vec(q[0], q[1], q[2]);
+						}
+					}
+					std::fill(p, p + 3 * tile * tile, 0.0f);
+				}
+			}
+		});
+	}
+
+	std::unique_ptr<float[]> newTile() const {
+		return std::unique_ptr<float[]>(new float[3 * tile * tile]());
+	}
+
+	int w, h, tile, tilesX, ntiles, nworkers;
+	std::vector<std::vector<std::unique_ptr<float[]>>> tiles;   // [worker][tile]
+};
+
+// splat throughput of SplatFilm against a shared buffer of atomic floats
+void benchmarkSplatting(int w, int h, long long splats) {
+	const int nworkers = scheduler.numWorkers(), batches = 64 * nworkers;
+	const long long perBatch = (splats + batches - 1) / batches;
+	typedef std::chrono::steady_clock Clock;
+
+	SplatFilm film(w, h, nworkers);
+	std::vector<Vec> dst(w * h);
+	auto start = Clock::now();
+	scheduler.parallelFor(0, batches, 1, [&](int begin, int end) {
+		for (long long n = (end - begin) * perBatch; n--;)
+			film.splat(int(rng() * w), int(rng() * h), Vec(1, 1, 1));
+	});
+	double tSplat = std::chrono::duration<double>(Clock::now() - start).count();
+	start = Clock::now();
+	film.merge(dst);
+	double tMerge = std::chrono::duration<double>(Clock::now() - start).count();
+
+	std::vector<std::atomic<float>> shared(3 * w * h);
+	for (size_t i = 0; i < shared.size(); i++) shared[i] = 0.0f;
+	start = Clock::now();
+	scheduler.parallelFor(0, batches, 1, [&](int begin, int end) {
+		for (long long n = (end - begin) * perBatch; n--;) {
+			int i = 3 * ((h - int(rng() * h) - 1) * w + int(rng() * w));
+			for (int c = 0; c < 3; c++) {
+				float old = shared[i + c].load(std::memory_order_relaxed);
+				while (!shared[i + c].compare_exchange_weak(old, old + 1.0f, std::memory_order_relaxed)) {}
+			}
+		}
+	});
+	double tAtomic = std::chrono::duration<double>(Clock::now() - start).count();
+
+	double total = 0;
+	for (int i = 0; i < w*h; i++) total += dst[i].x;
+	long long n = perBatch * batches;
+	fprintf(stderr, "%lld splats on %dx%d with %d workers (film total %.0f)\n", n, w, h, nworkers, total);
+	fprintf(stderr, "  film tiles   %8.2f Msplats/s (splat %.3fs + merge %.3fs)\n", n / (tSplat + tMerge) * 1e-6, tSplat, tMerge);
+	fprintf(stderr, "  atomic float %8.2f Msplats/s (%.3fs)\n", n / tAtomic * 1e-6, tAtomic);
+}
+
+// PPM body for the output rows [row0, row1), row 0 being the top of the image
+std::string encodeRows(const Accumulator &acc, int row0, int row1) {
+	std::string out;
+	char buf[48];
+	for (int i = row0 * acc.w; i < row1 * acc.w; i++) {
+		Vec p = acc.value(i);
+		out.append(buf, snprintf(buf, sizeof(buf), "%d %d %d ", toInt(p.x), toInt(p.y), toInt(p.z)));
+	}
+	return out;
+}
+
+// writes acc to path, filling each stride x stride block from its traced
+// corner pixel; the file is replaced atomically so viewers never see half an image
+void writeImage(const char *path, const Accumulator &acc, int stride = 1) {
+	const int w = acc.w, h = acc.h;
+	std::string tmp = std::string(path) + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f) return;
+	fprintf(f, "P3\n%d %d\n%d\n", w, h, 255);
+	for (int row = 0; row < h; row++) {
+		int y = h - row - 1;
+		for (int x = 0; x < w; x++) {
+			Vec p = acc.value((h - (y - y % stride) - 1)*w + (x - x % stride));
+			fprintf(f, "%d %d %d ", toInt(p.x), toInt(p.y), toInt(p.z));
+		}
+	}
+	fclose(f);
+	rename(tmp.c_str(), path);
+}
+
+// tent-filtered camera ray through subpixel (sx, sy) of pixel (x, y); with
+// blue noise on, the sampler is primed for sample `index` of that subpixel and
+// the caller clears the prefix once the path is done
+Ray cameraRay(const Vec &cx, const Vec &cy, int w, int h, int x, int y, int sx, int sy, int index) {
+	if (blueNoise.enabled) {
+		double u[BlueNoise::Dims];
+		for (int d = 0; d < BlueNoise::Dims; d++) u[d] = blueNoise.value(x, y, d, 4 * index + 2 * sy + sx);
+		rng.setPrefix(u, BlueNoise::Dims);
+	}
+	double r1 = 2 * rng(), dx = r1<1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
+	double r2 = 2 * rng(), dy = r2<1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
+	Vec d = cx*(((sx + .5 + dx) / 2 + x) / w - .5) +
+		cy*(((sy + .5 + dy) / 2 + y) / h - .5) + cam.d;
+	double time = sphereBVH.motion ? rng() : 0;
+	return Ray(cam.o, d.normalize(), time);
+}
+
+// mean of ps tent-filtered camera samples in subpixel (sx, sy) of pixel (x, y);
+// first is the number of samples this subpixel has had before
+Vec subpixelMean(const Vec &cx, const Vec &cy, int w, int h, int x, int y, int sx, int sy, int ps, int first) {
+	Vec r;
+	for (int s = 0; s<ps; s++) {
+		regularization.begin(first + s);
+		r = r + estimate(cameraRay(cx, cy, w, h, x, y, sx, sy, first + s))*(1. / ps);
+		rng.setPrefix(0, 0);
+	}
+	return r;
+}
+
+// pixels on a grid of the given stride, minus those already on a coarser one;
+// or, given a flag per pixel (indexed like Accumulator), the flagged ones
+struct PixelSubset {
+	PixelSubset(int stride_ = 1, int skip_ = 0) : stride(stride_), skip(skip_) {}
+	PixelSubset(const std::vector<char> &flags_, int w_, int h_) : stride(1), skip(0), flags(&flags_), w(w_), h(h_) {}
+
+	bool contains(int x, int y) const {
+		if (flags) return (*flags)[(h - y - 1)*w + x] != 0;
+		return x % stride == 0 && y % stride == 0 && !(skip && x % skip == 0 && y % skip == 0);
+	}
+
+	int stride, skip;
+	const std::vector<char> *flags = 0;
+	int w = 0, h = 0;
+};
+
+// --integrator direct a tile at a time: every camera sample renderTile() will
+// take is followed to its light sample in the same order (so the random
+// streams match), with the shadow rays traced as packets
+std::vector<Vec> directLightingTile(const Accumulator &acc, const Vec &cx, const Vec &cy, int x0, int y0, int x1, int y1, int ps,
+	const PixelSubset &subset) {
+	const int w = acc.w, h = acc.h;
+	std::vector<Vec> out;
+	out.reserve(size_t(x1 - x0) * (y1 - y0) * 4 * ps);     // the batch keeps pointers into it
+	DirectBatch batch;
+	for (int y = y0; y < y1; y++)
+		for (int x = x0; x < x1; x++) {
+			if (!subset.contains(x, y)) continue;
+			const int i = (h - y - 1)*w + x;
+			for (int sub = 0; sub < 4; sub++)
+				for (int s = 0; s < ps; s++) {
+					regularization.begin(acc.samps[i] + s);
+					out.push_back(Vec());
+					batch.add(cameraRay(cx, cy, w, h, x, y, sub % 2, sub / 2, acc.samps[i] + s), out.back());
+					rng.setPrefix(0, 0);
+				}
+		}
+	batch.flush();
+	return out;
+}
+
+void renderTile(Accumulator &acc, const Vec &cx, const Vec &cy, int x0, int y0, int x1, int y1, int ps,
+	const PixelSubset &subset) {
+	const int w = acc.w, h = acc.h;
+	// samples precomputed for the tile, consumed in the order subpixelMean() would trace them
+	std::vector<Vec> batch;
+	size_t next = 0;
+	// (batched samples are shaded before the per-pixel material masks are taken)
+	if (integrator.mode == PreviewIntegrator::Direct && shadowPackets.used() && acc.materials.empty())
+		batch = directLightingTile(acc, cx, cy, x0, y0, x1, y1, ps, subset);
+	auto mean = [&](int x, int y, int sx, int sy, int n, int first) {
+		if (batch.empty()) return subpixelMean(cx, cy, w, h, x, y, sx, sy, n, first);
+		Vec r;
+		for (int s = 0; s < n; s++) r = r + batch[next++]*(1. / n);
+		return r;
+	};
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			if (!subset.contains(x, y)) continue;
+			const int i = (h - y - 1)*w + x;
+			MaterialTable::touched = 0;
+
+			for (int sy = 0; sy < 2; ++sy) {
+				for (int sx = 0; sx < 2; ++sx) {
+					Vec sum;
+					if (acc.nbuckets) {
+						// sample n of subpixel sub goes to bucket (n + sub) mod K, so
+						// every bucket sees every subpixel
+						for (int s = 0; s < ps; s++) {
+							Vec e = mean(x, y, sx, sy, 1, acc.samps[i] + s);
+							acc.addSample(i, (acc.samps[i] + s + 2 * sy + sx) % acc.nbuckets, e);
+							sum = sum + e;
+						}
+					}
+					else sum = mean(x, y, sx, sy, ps, acc.samps[i]) * ps;
+					acc.sub[4 * i + 2 * sy + sx] = acc.sub[4 * i + 2 * sy + sx] + sum;
+					if (!acc.count.empty()) {
+						Vec v = clamp(sum * (1.0 / ps));
+						double l = (v.x + v.y + v.z) / 3;
+						acc.lum[i] += l;
+						acc.lum2[i] += l*l;
+						acc.count[i]++;
+					}
+				}
+			}
+			acc.samps[i] += ps;
+			acc.resolve(i);
+			if (!acc.materials.empty()) acc.materials[i] |= MaterialTable::touched;
+		}
+	}
+}
+
+// traces samps samples per subpixel into the pixels of acc in subset with the
+// current settings and returns the tasks of the last pass spawned (still
+// running when returned). aspect, if given, is the frame's width / height in
+// place of acc's, for images that resample another frame
+std::vector<TaskRef> render(Accumulator &acc, int samps, PixelSubset subset = PixelSubset(), double aspect = 0) {
+	const int w = acc.w, h = acc.h, tile = settings.tile, sampsPerPass = settings.sampsPerPass;
+	const int tilesX = (w + tile - 1) / tile, tilesY = (h + tile - 1) / tile, ntiles = tilesX * tilesY;
+	const Vec cx = aspect > 0 ? Vec(aspect*.5135) : Vec(w*.5135 / h), cy = (cx.cross(cam.d)).normalize()*.5135;
+	control.samps = samps;
+	control.sampsPerPass = sampsPerPass;
+	control.totalTiles = ntiles;
+	control.totalPasses = (samps + sampsPerPass - 1) / sampsPerPass;
+	static std::mutex printLock;
+
+	// at most two passes are in flight: pass p is spawned before pass p-2 is retired
+	std::vector<TaskRef> prev(ntiles), cur(ntiles), older(ntiles);
+	std::shared_ptr<std::vector<std::atomic<int>>> remaining(new std::vector<std::atomic<int>>(control.totalPasses));
+	for (int pass = 0; pass < control.totalPasses && !control.halted(); pass++) {
+		const int ps = std::min(sampsPerPass, samps - pass * sampsPerPass);
+		(*remaining)[pass] = ntiles;
+
+		for (int k = 0; k < ntiles; k++) {
+			cur[k] = scheduler.spawn([&acc, remaining, cx, cy, k, pass, ps, tile, tilesX, w, h, samps, subset]() {
+				control.waitIfPaused();
+				if (!control.halted()) {
+					auto start = std::chrono::steady_clock::now();
+					int x0 = (k % tilesX) * tile, y0 = (k / tilesX) * tile;
+					renderTile(acc, cx, cy, x0, y0, std::min(x0 + tile, w), std::min(y0 + tile, h), ps, subset);
+
+					ThreadStats &ts = control.threads[TaskScheduler::workerId()];
+					ts.busy = ts.busy.load() + std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+					control.tilesDone++;
+					if (!control.quiet) {
+						std::lock_guard<std::mutex> g(printLock);
+						fprintf(stderr, "\rRendering (%d spp) %6.2f%%", samps * 4, 100.*control.progress());
+					}
+				}
+				if (--(*remaining)[pass] == 0 && !control.halted()) control.passesDone++;
+			}, std::vector<TaskRef>(1, prev[k]));
+		}
+		scheduler.waitAll(older);
+		older.swap(prev);
+		prev.swap(cur);
+	}
+	scheduler.waitAll(older);
+	return prev;
+}
+
+// (re)starts the workers, RNG streams and statistics for n threads
+void startWorkers(int nworkers) {
+	scheduler.shutdown();
+	scheduler.init(nworkers);
+	rng.init(nworkers);
+	control.init(nworkers);
+	shadowCache.init(nworkers);
+}
+
+/*
+* Calibration: short probe renders of the actual scene at quarter resolution,
+* tuning one setting at a time (coordinate descent) from the current profile
+* for the best efficiency 1 / (variance x time), then saving the result.
+* Threads, tiles and samples per pass are throughput knobs, so they are
+* compared on time alone against the baseline variance rather than on noisy
+* variance estimates. Pass size leaves the image unchanged because the
+* accumulator sums unclamped subpixel radiance and clamps once at resolve.
+*/
+
+struct ProbeResult {
+	double time, variance;
+};
+
+ProbeResult probe(int hwThreads, int samps) {
+	startWorkers(settings.threads ? settings.threads : hwThreads);
+	Accumulator acc(480 / 4, 360 / 4, true);
+	auto start = std::chrono::steady_clock::now();
+	scheduler.waitAll(render(acc, samps));
+	ProbeResult r;
+	r.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	r.variance = acc.meanVariance();
+	return r;
+}
 
-	return rad;
+template <typename T>
+void tune(const char *name, T &param, const std::vector<T> &candidates, bool changesEstimator,
+	int hwThreads, int samps, ProbeResult &best) {
+	T chosen = param;
+	for (size_t k = 0; k < candidates.size(); k++) {
+		if (candidates[k] == chosen) continue;
+		param = candidates[k];
+		ProbeResult r = probe(hwThreads, samps);
+		if (!changesEstimator) r.variance = best.variance;
+		fprintf(stderr, "  %-12s %8g  %7.3fs  efficiency %10.4g\n", name, double(param), r.time, 1.0 / (r.variance * r.time));
+		if (r.variance * r.time < best.variance * best.time) { best = r; chosen = param; }
+	}
+	param = chosen;
 }
 
-//////////////////////////GENERAL RADIANCE FUNCTION
-Vec radiance(const Ray &r, const Sphere &s, Vec xN, int depth, bool flag) {
-	Vec rad;
-	rad = s.e + reflectedRadiance(r, s, xN, depth, flag);		//reflectedRadiance requires the sphere that was intersected with to operate to call directradiance
-	return rad;
+void calibrate(const char *profilePath, int hwThreads) {
+	const int samps = 4;
+	control.quiet = true;
+	if (!settings.sampsPerPass) settings.sampsPerPass = 1;
+	if (!settings.threads) settings.threads = hwThreads;
+
+	fprintf(stderr, "Calibrating (%d spp probes)\n", samps * 4);
+	ProbeResult best = probe(hwThreads, samps);
+	fprintf(stderr, "  %-12s %8s  %7.3fs  efficiency %10.4g\n", "baseline", "", best.time, 1.0 / (best.variance * best.time));
+	std::vector<int> threadCounts;
+	for (int n = hwThreads; n >= 1; n /= 2) threadCounts.push_back(n);
+	tune("threads", settings.threads, threadCounts, false, hwThreads, samps, best);
+	tune("tile", settings.tile, std::vector<int>{ 8, 16, 32, 64 }, false, hwThreads, samps, best);
+	tune("spp_per_pass", settings.sampsPerPass, std::vector<int>{ 1, 2, 4 }, false, hwThreads, samps, best);
+	tune("rr_depth", settings.rrDepth, std::vector<int>{ 2, 3, 5, 8 }, true, hwThreads, samps, best);
+	tune("survival", settings.survivalProbability, std::vector<float>{ 0.5f, 0.7f, 0.8f, 0.9f }, true, hwThreads, samps, best);
+	tune("light_split", settings.lightSplit, std::vector<int>{ 1, 2, 4 }, true, hwThreads, samps, best);
+	tune("brdf_split", settings.brdfSplit, std::vector<int>{ 1, 2, 4 }, true, hwThreads, samps, best);
+
+	if (settings.save(profilePath)) fprintf(stderr, "Saved profile %s\n", profilePath);
+	else fprintf(stderr, "Cannot write profile %s\n", profilePath);
+	control.quiet = false;
 }
 
+// traces the whole image and writes it to path, encoding each band of output
+// rows as soon as the last pass's tiles covering it are done
+void renderAndWrite(Accumulator &acc, int samps, const char *path, PixelSubset subset = PixelSubset()) {
+	const int w = acc.w, h = acc.h;
+	std::vector<TaskRef> last = render(acc, samps, subset);
 
-/////////////////////////////REFLECTED RADIANCE FUNCTION
-Vec reflectedRadiance(const Ray &r, const Sphere &s, Vec xN, int depth, bool flag) {		// r has the current  position and the direction of the ray pointing to the previous x poistion
-	Vec rad;			// rad is the reflected radiance at this point
-	const Sphere &light = spheres[7];
-	if (flag) {
-		rad = indirectRadiance2(r, s, xN, depth);
-	}
-	else {
-		rad = directRadiance(r, s, light, xN, depth) + indirectRadiance1(r, s, xN, depth);
+	const int tile = settings.tile, tilesX = (w + tile - 1) / tile, tilesY = (h + tile - 1) / tile;
+	std::vector<std::string> bands(tilesY);
+	std::vector<TaskRef> encoders(tilesY);
+	for (int ty = 0; ty < tilesY; ty++) {
+		std::vector<TaskRef> deps(last.begin() + ty * tilesX, last.begin() + (ty + 1) * tilesX);
+		int y0 = ty * tile, y1 = std::min(y0 + tile, h);
+		encoders[ty] = scheduler.spawn([&, ty, y0, y1]() { bands[ty] = encodeRows(acc, h - y1, h - y0); }, deps);
 	}
+	scheduler.waitAll(encoders);
 
-	return rad;
+	// Write resulting image to a PPM file
+	FILE *f = fopen(path, "w");
+	fprintf(f, "P3\n%d %d\n%d\n", w, h, 255);
+	for (int ty = tilesY; ty--;) fputs(bands[ty].c_str(), f);
+	fclose(f);
 }
 
-/////////////////////////////DIRECT RADIANCE 		//pass in the sphere to be used as the luminaired source (can access stuff like emitted radiance)
-//also pass in brdf of whatever sphere the ray "r" is originating from
-Vec directRadiance(const Ray &r, const Sphere &s, const Sphere &lSource, Vec xN, int depth) {
-	Vec result = Vec();
-	Vec y, yN, dirRad;
-	double pdf, r2;
-	luminaireSample(lSource, y, yN, pdf);
-	dirRad = (y - r.o).normalize();
-	Ray toLight(r.o, dirRad);
-	Ray yNormal(y, yN);
-	r2 = (y - r.o).dot((y - r.o));
-	result = ((lSource.e).mult(s.brdf.eval(xN, r.d, dirRad))) * visible(toLight, yNormal) * xN.dot(dirRad) * yN.dot((Vec() - dirRad).normalize()) * (1.0 / (r2 * pdf));		//Change what goes into "visible"
-	return result;
+void renderPreview(Accumulator &acc, int samps, const char *path) {
+	// coarse stages are kept: their pixels are also pixels of the finer grids
+	const int strides[] = { 4, 2, 1 };
+	for (int k = 0; k < 3 && !control.halted(); k++) {
+		scheduler.waitAll(render(acc, samps, PixelSubset(strides[k], k ? strides[k - 1] : 0)));
+		writeImage(path, acc, strides[k]);
+		fprintf(stderr, "\nPreview 1/%d written after %.2fs", strides[k] * strides[k], control.renderTime());
+	}
 }
 
-////////////////////////////INDIRECT RADIANCE1	(must recursively call the reflectiveRadiance function)
+/*
+* Sample-parallel rendering for small images at high sample counts: work is
+* split over (tile, sample chunk) pairs so that there are enough tasks for all
+* workers even when there are only a handful of tiles. Each chunk accumulates
+* unclamped subpixel sums into its own float buffer from an RNG stream seeded
+* by (tile, chunk), and the buffers are summed in a fixed pairwise tree, so
+* the image does not depend on the thread count or on scheduling. Clamping
+* happens after the reduction, as in a single-pass render.
+*/
 
-Vec indirectRadiance1(const Ray &r, const Sphere &s, Vec xN, int depth) {
-	Vec incDir, rad;
-	int rrDepth = 5, id = 0;
-	float survivalProbability = 0.9;
-	float p, randVal;
-	double t, probDF;                                   // t = Distance to intersection
+void renderSampleParallel(Accumulator &acc, int samps) {
+	const int w = acc.w, h = acc.h, tile = settings.tile;
+	const int tilesX = (w + tile - 1) / tile, tilesY = (h + tile - 1) / tile, ntiles = tilesX * tilesY;
+	const Vec cx = Vec(w*.5135 / h), cy = (cx.cross(cam.d)).normalize()*.5135;
+	const int stride = 12;              // floats per pixel: RGB for each of the 2x2 subpixels
+	if (samps < 1) return;
 
-	if (depth <= rrDepth) {
-		p = 1.0;
+	// at least 256 tasks and no more than 256MB of chunk buffers; the split does
+	// not depend on the worker count, so neither does the image
+	long long maxChunks = std::max(1LL, (256LL << 20) / (4LL * stride * w * h));
+	int nchunks = std::min<long long>(std::min(samps, (256 + ntiles - 1) / ntiles), maxChunks);
+	const int chunkSamps = (samps + nchunks - 1) / nchunks;
+	nchunks = (samps + chunkSamps - 1) / chunkSamps;
+
+	std::vector<std::vector<float>> buf(nchunks, std::vector<float>(stride * w * h));
+	std::vector<char> done(ntiles * nchunks);
+	control.samps = samps;
+	control.sampsPerPass = samps;
+	control.totalTiles = ntiles * nchunks;
+	control.totalPasses = 1;
+
+	scheduler.parallelFor(0, ntiles * nchunks, 1, [&](int begin, int end) {
+		for (int j = begin; j < end; j++) {
+			control.waitIfPaused();
+			if (control.halted()) continue;
+			const int k = j % ntiles, chunk = j / ntiles, ps = std::min(chunkSamps, samps - chunk * chunkSamps);
+			const int x0 = (k % tilesX) * tile, y0 = (k / tilesX) * tile;
+			rng.reseed(k, chunk);
+			for (int y = y0; y < std::min(y0 + tile, h); y++) {
+				for (int x = x0; x < std::min(x0 + tile, w); x++) {
+					float *p = &buf[chunk][stride * ((h - y - 1)*w + x)];
+					for (int sy = 0; sy < 2; ++sy) {
+						for (int sx = 0; sx < 2; ++sx, p += 3) {
+							Vec v = subpixelMean(cx, cy, w, h, x, y, sx, sy, ps, chunk * chunkSamps)*ps;
+							p[0] = float(v.x); p[1] = float(v.y); p[2] = float(v.z);
+						}
+					}
+				}
+			}
+			done[j] = 1;
+			control.tilesDone++;
+		}
+	});
+
+	// pairwise tree: level `step` adds chunk k + step into chunk k
+	for (int step = 1; step < nchunks; step *= 2) {
+		const int pairs = (nchunks - step + 2 * step - 1) / (2 * step);
+		scheduler.parallelFor(0, pairs, 1, [&](int begin, int end) {
+			for (int q = begin; q < end; q++) {
+				float *a = &buf[2 * step * q][0], *b = &buf[2 * step * q + step][0];
+				scheduler.parallelFor(0, stride * w * h, 1 << 14, [=](int i0, int i1) {
+					for (int i = i0; i < i1; i++) a[i] += b[i];
+				});
+			}
+		});
 	}
-	else {
-		p = survivalProbability;
+
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			const int k = (y / tile) * tilesX + x / tile, i = (h - y - 1)*w + x;
+			int n = 0;
+			for (int chunk = 0; chunk < nchunks; chunk++)
+				if (done[chunk * ntiles + k]) n += std::min(chunkSamps, samps - chunk * chunkSamps);
+			const float *p = &buf[0][stride * i];
+			for (int sub = 0; sub < 4; sub++, p += 3) acc.sub[4 * i + sub] = Vec(p[0], p[1], p[2]);
+			acc.samps[i] = n;
+			acc.resolve(i);
+		}
 	}
-	randVal = rng();
-	if (randVal < p) {
-		s.brdf.sample(xN, r.d, incDir, probDF);
-		Ray xOut(r.o, incDir);
-		if (!intersect(xOut, t, id)) return Vec();   // if miss, return black
-		const Sphere &obj = spheres[id];            // the hit object
+	control.passesDone = 1;
+}
 
-		Vec x = xOut.o + xOut.d*t;                        // The intersection point  //x-1
-		Vec o = (Vec() - xOut.d).normalize();          // The outgoing direction (= -r.d)  //wicurr
 
-		Vec n = (x - obj.p).normalize();            // The normal direction	//n at x-1
-		if (n.dot(o) < 0) n = n*-1.0;
+/*
+* Path-space filtering (Keller et al. 2016): every pass traces one path per
+* subpixel, records its first diffuse vertex, and replaces the radiance
+* reflected there by the average over recorded vertices within a radius on the
+* same object with a similar normal. Vertices are found through a hashed grid
+* of radius-sized cells. What is averaged is the reflected radiance divided by
+* the vertex's albedo, which is multiplied back afterwards, so only the
+* lighting blurs and surface colour stays sharp.
+*/
 
-		bool isSpec = obj.brdf.isSpecular();		//checking to see if sphere that was collided is specular or not
+struct PathSpaceFilter {
+	struct Vertex {
+		float x[3], n[3];
+		float lighting[3];      // reflected radiance / albedo at the vertex
+		float emitted[3];       // emission collected along the path up to the vertex
+		float weight[3];        // path throughput times albedo
+		int id;                 // -1: the path found no diffuse vertex
+	};
 
-		Ray outgoing(x, o);			//outgoing ray at position x (which is x-1)
-		rad = (reflectedRadiance(outgoing, obj, n, (depth + 1), isSpec)).mult(s.brdf.eval(xN, r.d, incDir)) * xN.dot(incDir) * (1.0 / (probDF * p));
+	// the camera path up to its first diffuse vertex, following mirrors
+	static void trace(Ray r, Vertex &v) {
+		Vec throughput(1, 1, 1), emitted;
+		v.id = -1;
+		for (int depth = 1; depth <= 8; depth++) {
+			Hit hit;
+			if (!intersect(r, hit)) break;
+			Interaction it(r, hit);
+			const Sphere &obj = it.surface();
+			Vec n = it.normal();
+			Ray outgoing = it.outgoing();
+			emitted = emitted + throughput.mult(obj.e);
+			const Vec albedo = obj.brdf.albedo();
+			if (!obj.brdf.isSpecular()) {
+				Vec lr = reflectedRadiance(outgoing, obj, n, depth, false);
+				Vec lighting(albedo.x > 0 ? lr.x / albedo.x : 0, albedo.y > 0 ? lr.y / albedo.y : 0, albedo.z > 0 ? lr.z / albedo.z : 0);
+				store(v.x, outgoing.o);
+				store(v.n, n);
+				store(v.lighting, lighting);
+				store(v.weight, throughput.mult(albedo));
+				v.id = hit.id;
+				break;
+			}
+			Vec dir;
+			double pdf;
+			obj.brdf.sample(n, outgoing.d, dir, pdf);
+			throughput = throughput.mult(albedo);
+			r = Ray(outgoing.o, dir, r.time);
+		}
+		store(v.emitted, emitted);
 	}
-	else {
-		rad = Vec();
+
+	// hashes the vertices into a table of radius-sized cells
+	void build(const std::vector<Vertex> &vertices) {
+		size_t size = 1;
+		while (size < 2 * vertices.size()) size *= 2;
+		mask = size - 1;
+		start.assign(size + 1, 0);
+		for (size_t k = 0; k < vertices.size(); k++)
+			if (vertices[k].id >= 0) start[cellOf(vertices[k].x) + 1]++;
+		for (size_t c = 0; c < size; c++) start[c + 1] += start[c];
+		entries.resize(start[size]);
+		std::vector<int> fill(start.begin(), start.end() - 1);
+		for (size_t k = 0; k < vertices.size(); k++)
+			if (vertices[k].id >= 0) entries[fill[cellOf(vertices[k].x)]++] = int(k);
 	}
 
-	return rad;
-}
+	// filtered lighting at vertex v; the 27 cells around it cover the radius
+	Vec filter(const std::vector<Vertex> &vertices, const Vertex &v, int &neighbours) const {
+		Vec sum;
+		neighbours = 0;
+		const double r2 = radius * radius;
+		int c[3];
+		for (int a = 0; a < 3; a++) c[a] = int(std::floor(v.x[a] / radius));
+		for (int dz = -1; dz <= 1; dz++) for (int dy = -1; dy <= 1; dy++) for (int dx = -1; dx <= 1; dx++) {
+			size_t cell = hash(c[0] + dx, c[1] + dy, c[2] + dz);
+			for (int e = start[cell]; e < start[cell + 1]; e++) {
+				const Vertex &u = vertices[entries[e]];
+				if (u.id != v.id) continue;
+				double d2 = 0, cosN = 0;
+				for (int a = 0; a < 3; a++) {
+					d2 += (u.x[a] - v.x[a]) * (u.x[a] - v.x[a]);
+					cosN += u.n[a] * v.n[a];
+				}
+				if (d2 > r2 || cosN < minCosine) continue;
+				sum = sum + Vec(u.lighting[0], u.lighting[1], u.lighting[2]);
+				neighbours++;
+			}
+		}
+		return neighbours ? sum * (1.0 / neighbours) : Vec();
+	}
 
-////////////////////////////INDIRECT RADIANCE2	(must recursively call the radiance function)
-Vec indirectRadiance2(const Ray &r, const Sphere &s, Vec xN, int depth) {
-	Vec incDirR, rad;
-	int rrDepth = 5, id = 0;
-	float survivalProbability = 0.9;
-	float p, randVal;
-	double t, probDFR;				// t = Distance to intersection
-									//double probDFS;
+	double radius = 2.0;        // world units
+	double minCosine = 0.9;     // normals of shared vertices must agree this closely
 
-	rad = Vec();
+private:
+	static void store(float *dst, const Vec &v) { dst[0] = float(v.x); dst[1] = float(v.y); dst[2] = float(v.z); }
 
-	if (depth <= rrDepth) {
-		p = 1.0;
+	size_t hash(int x, int y, int z) const {
+		return ((unsigned(x) * 73856093u) ^ (unsigned(y) * 19349663u) ^ (unsigned(z) * 83492791u)) & mask;
 	}
-	else {
-		p = survivalProbability;
+
+	size_t cellOf(const float *x) const {
+		return hash(int(std::floor(x[0] / radius)), int(std::floor(x[1] / radius)), int(std::floor(x[2] / radius)));
 	}
-	randVal = rng();
-	if (randVal < p) {
-		s.brdf.sample(xN, r.d, incDirR, probDFR);
-		Ray xOutR(r.o, incDirR);
 
-		if (!intersect(xOutR, t, id)) return Vec();   // if miss, return black
-		const Sphere &obj = spheres[id];            // the hit object
+	size_t mask = 0;
+	std::vector<int> start, entries;
+} pathSpaceFilter;
 
-		Vec x = xOutR.o + xOutR.d*t;                        // The intersection point  //x-1
-		Vec o = (Vec() - xOutR.d).normalize();          // The outgoing direction (= -r.d)  //wicurr
+void renderPathSpaceFiltered(Accumulator &acc, int samps) {
+	const int w = acc.w, h = acc.h;
+	const Vec cx = Vec(w*.5135 / h), cy = (cx.cross(cam.d)).normalize()*.5135;
+	std::vector<PathSpaceFilter::Vertex> vertices(4 * w * h);     // subpixel (sx, sy) of pixel i at 4 * i + 2 * sy + sx
+	control.samps = samps;
+	control.sampsPerPass = 1;
+	control.totalTiles = h;
+	control.totalPasses = samps;
+	long long shared = 0, filtered = 0;
 
-		Vec n = (x - obj.p).normalize();            // The normal direction	//n at x-1
-		if (n.dot(o) < 0) n = n*-1.0;
+	for (int pass = 0; pass < samps && !control.halted(); pass++) {
+		// rows are seeded by (row, pass), so the image does not depend on the thread count
+		scheduler.parallelFor(0, h, 1, [&](int begin, int end) {
+			for (int y = begin; y < end; y++) {
+				control.waitIfPaused();
+				rng.reseed(y, pass);
+				regularization.begin(pass);
+				for (int x = 0; x < w; x++) {
+					for (int sub = 0; sub < 4; sub++) {
+						PathSpaceFilter::trace(cameraRay(cx, cy, w, h, x, y, sub % 2, sub / 2, pass),
+							vertices[4 * ((h - y - 1)*w + x) + sub]);
+						rng.setPrefix(0, 0);
+					}
+				}
+				control.tilesDone++;
+			}
+		});
+		pathSpaceFilter.build(vertices);
+		std::atomic<long long> passShared{ 0 }, passFiltered{ 0 };
+		scheduler.parallelFor(0, w * h, 256, [&](int begin, int end) {
+			long long n = 0, m = 0;
+			for (int i = begin; i < end; i++) {
+				for (int sub = 0; sub < 4; sub++) {
+					const PathSpaceFilter::Vertex &vertex = vertices[4 * i + sub];
+					Vec p(vertex.emitted[0], vertex.emitted[1], vertex.emitted[2]);
+					if (vertex.id >= 0) {
+						int neighbours;
+						Vec lighting = pathSpaceFilter.filter(vertices, vertex, neighbours);
+						p = p + Vec(vertex.weight[0], vertex.weight[1], vertex.weight[2]).mult(lighting);
+						n += neighbours;
+						m++;
+					}
+					acc.sub[4 * i + sub] = acc.sub[4 * i + sub] + p;
+				}
+				acc.samps[i]++;
+				acc.resolve(i);
+			}
+			passShared += n;
+			passFiltered += m;
+		});
+		shared += passShared;
+		filtered += passFiltered;
+		control.passesDone++;
+	}
+	if (!control.quiet)
+		fprintf(stderr, "\nPath-space filtering: %.1f vertices shared per diffuse vertex (radius %g)\n",
+			filtered ? double(shared) / filtered : 0.0, pathSpaceFilter.radius);
+}
 
-		bool isSpec = obj.brdf.isSpecular();		//checking to see if sphere that was collided is specular or not
+// Light tracing through the splatting film: every pass traces one path per
+// subpixel from a uniform point on the luminaire, cosine-weighted, and
+// connects each diffuse vertex to the pinhole, splatting into whichever pixel
+// that lands in. The film's tiles merge into the image at the pass boundary.
+// Primary rays add the emission they see directly; anything seen only through
+// the mirror ball needs a camera-side bounce and stays black.
+void renderLightTraced(Accumulator &acc, int samps) {
+	const int w = acc.w, h = acc.h;
+	const Vec cx = Vec(w*.5135 / h), cy = (cx.cross(cam.d)).normalize()*.5135;
+	const Sphere &light = spheres[7];
+	// the pixel's area on the image plane at unit distance, with one path per
+	// subpixel and pass folded in
+	const double pixelArea = sqrt(cx.dot(cx) * cy.dot(cy)) / (w * h), perPath = 1.0 / (4 * w * h);
+	SplatFilm film(w, h, scheduler.numWorkers());
+	std::vector<Vec> splats(w * h), emitted(4 * w * h);
+	control.samps = samps;
+	control.sampsPerPass = 1;
+	control.totalTiles = h;
+	control.totalPasses = samps;
 
-		Ray outgoing(x, o);			//outgoing ray at position x (which is x-1)
-		rad = rad + (radiance(outgoing, obj, n, (depth + 1), isSpec)).mult(s.brdf.eval(xN, r.d, incDirR)) * xN.dot(incDirR) * (1.0 / p);
+	for (int pass = 0; pass < samps && !control.halted(); pass++) {
+		// rows are seeded by (row, pass), so the image does not depend on the thread count
+		scheduler.parallelFor(0, h, 1, [&](int begin, int end) {
+			for (int y = begin; y < end; y++) {
+				control.waitIfPaused();
+				rng.reseed(y, pass);
+				for (int x = 0; x < w; x++) {
+					for (int sub = 0; sub < 4; sub++) {
+						Ray r = cameraRay(cx, cy, w, h, x, y, sub % 2, sub / 2, pass);
+						rng.setPrefix(0, 0);
+						Hit hit;
+						emitted[4 * ((h - y - 1)*w + x) + sub] = intersect(r, hit) ? Interaction(r, hit).surface().e : Vec();
+					}
+				}
+				for (int k = 0; k < 4 * w; k++) {
+					const double time = sphereBVH.motion ? rng() : 0;
+					Vec p, np, u, v, nw;
+					double pdf;
+					luminaireSample(light, time, p, np, pdf);
+					double z = sqrt(rng()), s = sqrt(1 - z * z), phi = 2 * PI * rng();
+					createLocalCoord(np, u, v, nw);
+					// Le cos / (pdf * cos / PI)
+					Vec beta = light.e * (PI / pdf * perPath);
+					Ray r(p, (u * (s * cos(phi)) + v * (s * sin(phi)) + nw * z).normalize(), time);
+					for (int depth = 1;; depth++) {
+						Hit hit;
+						if (!intersect(r, hit)) break;
+						Interaction it(r, hit);
+						const Sphere &obj = it.surface();
+						Vec n = it.normal();
+						Ray outgoing = it.outgoing();
+						if (!obj.brdf.isSpecular()) {
+							Vec toCam = cam.o - outgoing.o;
+							double d2 = toCam.dot(toCam), dist = sqrt(d2);
+							Vec dir = toCam * (1 / dist);
+							double cosX = n.dot(dir), cosT = -dir.dot(cam.d);
+							// the point on the image plane at unit distance, in pixels
+							Vec onFilm = dir * (-1 / cosT);
+							double px = (onFilm.dot(cx) / cx.dot(cx) + .5) * w, py = (onFilm.dot(cy) / cy.dot(cy) + .5) * h;
+							Hit blocker;
+							if (cosX > 0 && cosT > 0 && px >= 0 && px < w && py >= 0 && py < h &&
+								!(intersect(Ray(outgoing.o, dir, time), blocker) && blocker.t < dist * (1 - 1e-6))) {
+								Vec f = obj.brdf.eval(n, outgoing.d, dir) * (cosX / (d2 * pixelArea * cosT * cosT * cosT));
+								film.splat(int(px), int(py), beta.mult(f));
+							}
+						}
+						float q = depth <= settings.rrDepth ? 1.0f : settings.survivalProbability;
+						if (rng() >= q) break;
+						Vec dir;
+						obj.brdf.sample(n, outgoing.d, dir, pdf);
+						beta = beta.mult(obj.brdf.eval(n, outgoing.d, dir) * (n.dot(dir) / (pdf * q)));
+						r = Ray(outgoing.o, dir, time);
+					}
+				}
+				control.tilesDone++;
+			}
+		});
+		film.merge(splats);
+		scheduler.parallelFor(0, w * h, 256, [&](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				for (int sub = 0; sub < 4; sub++) acc.sub[4 * i + sub] = acc.sub[4 * i + sub] + splats[i] + emitted[4 * i + sub];
+				splats[i] = Vec();
+				acc.samps[i]++;
+				acc.resolve(i);
+			}
+		});
+		control.passesDone++;
 	}
+}
 
-	return rad;
+// renders with the neural radiance cache: every pass traces one path per
+// subpixel, a 1/trainEvery share of them at full length for training, then
+// trains the cache on what those paths recorded before the next pass.
+// Subpixel sums stay unclamped until the end, as in a single-pass render
+void renderNeuralCached(Accumulator &acc, int samps) {
+	typedef std::chrono::steady_clock Clock;
+	const int w = acc.w, h = acc.h;
+	const Vec cx = Vec(w*.5135 / h), cy = (cx.cross(cam.d)).normalize()*.5135;
+	std::vector<Vec> sums(4 * w * h);
+	int passes = 0;
+	std::vector<std::vector<NeuralRadianceCache::Sample>> rowSamples(h);
+	std::vector<NeuralRadianceCache::Sample> samples;
+	control.samps = samps;
+	control.sampsPerPass = 1;
+	control.totalTiles = h;
+	control.totalPasses = samps;
+	double renderTime = 0, trainTime = 0;
+
+	for (int pass = 0; pass < samps && !control.halted(); pass++) {
+		auto start = Clock::now();
+		scheduler.parallelFor(0, h, 1, [&](int begin, int end) {
+			for (int y = begin; y < end; y++) {
+				control.waitIfPaused();
+				rng.reseed(y, pass);
+				regularization.begin(pass);
+				rowSamples[y].clear();
+				NeuralRadianceCache::sink = &rowSamples[y];
+				for (int x = 0; x < w; x++) {
+					for (int sub = 0; sub < 4; sub++) {
+						unsigned hash = (unsigned(4 * (y * w + x) + sub) * 2654435761u) ^ (unsigned(pass) * 40503u);
+						bool training = (hash >> 8) % radianceCache.trainEvery == 0;
+						NeuralRadianceCache::mode = training ? NeuralRadianceCache::Train :
+							radianceCache.trained ? NeuralRadianceCache::Query : NeuralRadianceCache::Off;
+						Vec &sum = sums[4 * ((h - y - 1)*w + x) + sub];
+						sum = sum + estimate(cameraRay(cx, cy, w, h, x, y, sub % 2, sub / 2, pass));
+						rng.setPrefix(0, 0);
+					}
+				}
+				NeuralRadianceCache::mode = NeuralRadianceCache::Off;
+				NeuralRadianceCache::sink = 0;
+				control.tilesDone++;
+			}
+		});
+		auto trained = Clock::now();
+		renderTime += std::chrono::duration<double>(trained - start).count();
+		samples.clear();
+		for (int y = 0; y < h; y++) samples.insert(samples.end(), rowSamples[y].begin(), rowSamples[y].end());
+		radianceCache.train(samples, pass);
+		trainTime += std::chrono::duration<double>(Clock::now() - trained).count();
+		control.passesDone++;
+		passes++;
+	}
+	for (int i = 0; passes && i < w * h; i++) {
+		Vec v;
+		for (int sub = 0; sub < 4; sub++) v = v + clamp(sums[4 * i + sub] * (1.0 / passes))*.25;
+		acc.c[i] = v * passes;
+		acc.samps[i] = passes;
+	}
+	if (!control.quiet)
+		fprintf(stderr, "\nRadiance cache: %d training samples in the last pass, loss %.4f, %.2fs tracing + %.2fs training\n",
+			int(samples.size()), radianceCache.lastLoss, renderTime, trainTime);
 }
 
+/*
+* Animation: --frames N renders frame000.ppm, frame001.ppm, ... while the
+* camera translates by --camera-move over the sequence. With --temporal each
+* pixel's first hit (through its centre) is projected into the previous
+* frame and the history there is resampled bilinearly, keeping only taps on
+* the same object whose stored hit lies on the same plane with a similar
+* normal. History blends with the new samples as a running mean capped at
+* --history frames; it is dropped where the new samples disagree with it by
+* more than three standard errors, and never used on mirrors, whose
+* reflections do not move with the surface. Pixels on object edges are not
+* reused either: their unclamped means include whatever the filter caught
+* of the neighbouring object (e.g. the light), which would trail behind it.
+*/
 
-////////////LUMINAIRE SAMPLE FUNCTION
+struct TemporalHistory {
+	struct Texel {
+		Vec sub[4];             // running means of the subpixels, clamped only for output
+		double lum = 0, lum2 = 0, n = 0;   // luminance moments and sample count behind them
+		Vec x, normal;          // first hit through the pixel centre
+		int id = -1;            // -1: no reusable hit
+		bool edge = false;      // a neighbour sees another object, so the filter footprint spans both
+	};
 
-void luminaireSample(const Sphere &s, Vec &i, Vec &ni, double &pdf) {		//LUMINARE SAMPLE IMPLEMENTATION (returns a point "i", normal to "i" called "ni", and a pdf.
-	float rand1, rand2, z, x, y;
-	rand1 = rng();
-	rand2 = rng();
-	z = (2.0 * rand1) - 1.0;
-	x = sqrt(1 - (pow(z, 2.0))) * cos(2.0 * PI * rand2);
-	y = sqrt(1 - (pow(z, 2.0))) * sin(2.0 * PI * rand2);
+	// pixel coordinates of p as seen from camera o (parallel cameras only translate)
+	static bool project(const Vec &p, const Vec &o, const Vec &cx, const Vec &cy, int w, int h, double &px, double &py) {
+		Vec q = p - o;
+		double depth = q.dot(cam.d);
+		if (depth <= 0) return false;
+		px = (q.dot(cx) / (depth * cx.dot(cx)) + .5) * w - .5;
+		py = (q.dot(cy) / (depth * cy.dot(cy)) + .5) * h - .5;
+		return px > -1 && px < w && py > -1 && py < h;
+	}
 
-	ni = Vec(x, y, z);
-	i = s.p + ni * s.rad;
-	pdf = (1.0 / (4.0 * PI * pow(s.rad, 2.0)));
+	// history of previous (seen from prevCam) reprojected onto t; false if no tap is valid
+	bool reproject(const Texel &t, const Vec &prevCam, const Vec &cx, const Vec &cy, int w, int h, Texel &out) const {
+		double px, py;
+		if (t.id < 0 || !project(t.x, prevCam, cx, cy, w, h, px, py)) return false;
+		int x0 = int(floor(px)), y0 = int(floor(py));
+		double fx = px - x0, fy = py - y0, total = 0;
+		double tolerance = 0.01 * sqrt((t.x - prevCam).dot(t.x - prevCam));
+		out = Texel();
+		for (int k = 0; k < 4; k++) {
+			int x = x0 + k % 2, y = y0 + k / 2;
+			if (x < 0 || x >= w || y < 0 || y >= h) continue;
+			const Texel &p = prev[(h - y - 1) * w + x];
+			if (p.id != t.id || p.edge || p.n <= 0 || fabs((t.x - p.x).dot(p.normal)) > tolerance || t.normal.dot(p.normal) < 0.9) continue;
+			double weight = (k % 2 ? fx : 1 - fx) * (k / 2 ? fy : 1 - fy);
+			for (int j = 0; j < 4; j++) out.sub[j] = out.sub[j] + p.sub[j] * weight;
+			out.lum += p.lum * weight;
+			out.lum2 += p.lum2 * weight;
+			out.n += p.n * weight;
+			total += weight;
+		}
+		if (total < 1e-3) return false;
+		for (int j = 0; j < 4; j++) out.sub[j] = out.sub[j] * (1 / total);
+		out.lum /= total; out.lum2 /= total; out.n /= total;
+		return true;
+	}
+
+	bool enabled = false;
+	double maxFrames = 16;      // --history
+	std::vector<Texel> prev, cur;
+	Vec prevCam;
+	bool valid = false;         // prev holds a frame
+} temporal;
+
+void renderAnimation(int w, int h, int samps, int frames, const Vec &move) {
+	const Vec cx = Vec(w*.5135 / h), cy = (cx.cross(cam.d)).normalize()*.5135;
+	const Vec start = cam.o;
+	temporal.prev.assign(w * h, TemporalHistory::Texel());
+	temporal.cur.assign(w * h, TemporalHistory::Texel());
+	temporal.valid = false;
+	control.samps = samps;
+	control.sampsPerPass = samps;
+	control.totalTiles = h;
+	control.totalPasses = frames;
+	for (int frame = 0; frame < frames && !control.halted(); frame++) {
+		cam.o = start + move * (frames > 1 ? double(frame) / (frames - 1) : 0.0);
+		std::atomic<long long> reused{0};
+		std::atomic<double> historyFrames{0.0};
+		scheduler.parallelFor(0, h, 1, [&](int begin, int end) {
+			for (int y = begin; y < end; y++) {
+				control.waitIfPaused();
+				rng.reseed(y, frame);
+				long long rowReused = 0;
+				double rowHistory = 0;
+				for (int x = 0; x < w; x++) {
+					const int i = (h - y - 1)*w + x;
+					TemporalHistory::Texel &t = temporal.cur[i];
+					t = TemporalHistory::Texel();
+					// first hit through the pixel centre for the next frame's tests
+					Vec d = cx*((x + .5) / w - .5) + cy*((y + .5) / h - .5) + cam.d;
+					Ray centre(cam.o, d.normalize());
+					Hit hit;
+					if (intersect(centre, hit)) {
+						Interaction it(centre, hit);
+						if (!it.surface().brdf.isSpecular()) { t.id = hit.id; t.x = it.position(); t.normal = it.normal(); }
+					}
+					double lum = 0, lum2 = 0;
+					for (int sub = 0; sub < 4; sub++) {
+						Vec sum;
+						for (int s = 0; s < samps; s++) {
+							// history carries samples across frames; without it each frame starts afresh
+							regularization.begin(temporal.enabled ? frame * samps + s : s);
+							Vec e = estimate(cameraRay(cx, cy, w, h, x, y, sub % 2, sub / 2, frame * samps + s));
+							rng.setPrefix(0, 0);
+							sum = sum + e;
+							double l = (clamp(e.x) + clamp(e.y) + clamp(e.z)) / 3;
+							lum += l;
+							lum2 += l * l;
+						}
+						t.sub[sub] = sum * (1.0 / samps);
+					}
+					double n = 4.0 * samps;
+					lum /= n; lum2 /= n;
+					TemporalHistory::Texel history;
+					if (temporal.enabled && temporal.valid && temporal.reproject(t, temporal.prevCam, cx, cy, w, h, history)) {
+						// the two means should agree within their standard errors
+						double var = std::max(std::max(lum2 - lum * lum, history.lum2 - history.lum * history.lum), 1e-4);
+						if (fabs(lum - history.lum) <= 3 * sqrt(var / n + var / history.n)) {
+							double m = std::min(history.n, temporal.maxFrames * n - n), a = n / (n + m);
+							for (int j = 0; j < 4; j++) t.sub[j] = history.sub[j] * (1 - a) + t.sub[j] * a;
+							lum = history.lum * (1 - a) + lum * a;
+							lum2 = history.lum2 * (1 - a) + lum2 * a;
+							n += m;
+							rowReused++;
+							rowHistory += m / (4.0 * samps);
+						}
+					}
+					t.lum = lum; t.lum2 = lum2; t.n = n;
+				}
+				reused += rowReused;
+				historyFrames = historyFrames.load() + rowHistory;
+				control.tilesDone++;
+			}
+		});
+		for (int y = 0; y < h; y++)
+			for (int x = 0; x < w; x++) {
+				TemporalHistory::Texel &t = temporal.cur[(h - y - 1)*w + x];
+				for (int k = 0; k < 9 && !t.edge; k++) {
+					int nx = std::min(w - 1, std::max(0, x + k % 3 - 1)), ny = std::min(h - 1, std::max(0, y + k / 3 - 1));
+					t.edge = temporal.cur[(h - ny - 1)*w + nx].id != t.id;
+				}
+			}
+		temporal.prev.swap(temporal.cur);
+		temporal.prevCam = cam.o;
+		temporal.valid = true;
+		Accumulator acc(w, h);
+		for (int i = 0; i < w * h; i++) {
+			for (int j = 0; j < 4; j++) acc.c[i] = acc.c[i] + clamp(temporal.prev[i].sub[j]) * .25;
+			acc.samps[i] = 1;
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "frame%03d.ppm", frame);
+		writeImage(name, acc);
+		control.passesDone++;
+		if (!control.quiet)
+			fprintf(stderr, "\rFrame %d/%d: %.1f%% of pixels reuse history, %.1f frames on average", frame + 1, frames,
+				100.0 * reused / (w * h), reused ? historyFrames / reused : 0.0);
+	}
+	cam.o = start;
 }
 
+/*
+* Draft rendering (--upsample F): full paths are traced at 1/F of the
+* resolution in x and y, and only primary hits at full resolution, for
+* albedo, emission, normal and depth. The low-resolution image is divided by
+* its own albedo, upsampled with a joint bilateral filter whose range terms
+* compare the full-resolution pixel's normal, depth and object with those of
+* each low-resolution sample, and multiplied back by the full-resolution
+* albedo, so texture and object edges stay sharp while the (smooth)
+* illumination comes from F^2 times fewer paths.
+*/
 
-// Visibility function
+struct Upsampler {
+	struct GBuffer {
+		Vec albedo, emission, normal;
+		double depth = 0;
+		int id = -1;
+	};
 
-int visible(const Ray &r, const Ray &n) {
-	double t;                                   // Distance to intersection
-	int id = 0;									// id of intersected sphere
-	if (!intersect(r, t, id)) {
-		return 0;
-	}
-	else {
-		if (id == 7) {
-			Vec fromLight = (Vec() - r.d).normalize();
-			if (fromLight.dot(n.d) > 0) {
-				return 1.0;
+	// primary hit AOVs of pixel (x, y): albedo and emission averaged over the
+	// four subpixel centres, geometry from the pixel centre
+	static GBuffer primary(const Vec &cx, const Vec &cy, int w, int h, int x, int y) {
+		GBuffer g;
+		for (int sub = 0; sub < 5; sub++) {
+			double fx = sub < 4 ? (sub % 2 + .5) / 2 : .5, fy = sub < 4 ? (sub / 2 + .5) / 2 : .5;
+			Vec d = cx*((x + fx) / w - .5) + cy*((y + fy) / h - .5) + cam.d;
+			Ray r(cam.o, d.normalize());
+			Hit hit;
+			if (!intersect(r, hit)) continue;
+			Interaction it(r, hit);
+			if (sub < 4) {
+				g.albedo = g.albedo + it.surface().brdf.albedo() * .25;
+				g.emission = g.emission + it.surface().e * .25;
 			}
 			else {
-				return 0.0;
+				g.normal = it.normal();
+				g.depth = hit.t;
+				g.id = hit.id;
 			}
 		}
-		else {
-			return 0;
-		}
+		return g;
 	}
+
+	int factor = 1;
+	double sigmaNormal = 0.3, sigmaDepth = 0.05;     // of 1 - cos, and of relative depth
+} upsampler;
+
+void renderUpsampled(Accumulator &acc, int samps) {
+	const int F = upsampler.factor, w = acc.w, h = acc.h, lw = (w + F - 1) / F, lh = (h + F - 1) / F;
+	const Vec cx = Vec(w*.5135 / h), cy = (cx.cross(cam.d)).normalize()*.5135;
+	std::vector<Upsampler::GBuffer> full(w * h), low(lw * lh);
+	auto start = std::chrono::steady_clock::now();
+	scheduler.parallelFor(0, h, 4, [&](int begin, int end) {
+		for (int y = begin; y < end; y++)
+			for (int x = 0; x < w; x++) full[(h - y - 1)*w + x] = Upsampler::primary(cx, cy, w, h, x, y);
+	});
+	double primaryTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// the low-resolution image is traced through the full-resolution frame, so
+	// pixel (lx, ly) spans full pixels [lx*sx, lx*sx + sx) x [ly*sy, ly*sy + sy);
+	// sx, sy fall a little short of F where F does not divide w or h
+	const double sx = double(w) / lw, sy = double(h) / lh;
+	Accumulator lowAcc(lw, lh);
+	scheduler.waitAll(render(lowAcc, samps, PixelSubset(), double(w) / h));
+	std::vector<Vec> irradiance(lw * lh);
+	for (int ly = 0; ly < lh; ly++)
+		for (int lx = 0; lx < lw; lx++) {
+			Upsampler::GBuffer &g = low[(lh - ly - 1)*lw + lx];
+			const int x0 = int(lx * sx), x1 = std::max(x0 + 1, std::min(w, int((lx + 1) * sx)));
+			const int y0 = int(ly * sy), y1 = std::max(y0 + 1, std::min(h, int((ly + 1) * sy)));
+			int n = 0;
+			for (int y = y0; y < y1; y++)
+				for (int x = x0; x < x1; x++, n++) {
+					g.albedo = g.albedo + full[(h - y - 1)*w + x].albedo;
+					g.emission = g.emission + full[(h - y - 1)*w + x].emission;
+				}
+			g.albedo = g.albedo * (1.0 / n);
+			g.emission = g.emission * (1.0 / n);
+			const Upsampler::GBuffer &centre = full[(h - std::min(h - 1, int((ly + .5) * sy)) - 1)*w + std::min(w - 1, int((lx + .5) * sx))];
+			g.normal = centre.normal;
+			g.depth = centre.depth;
+			g.id = centre.id;
+			Vec v = lowAcc.value((lh - ly - 1)*lw + lx) - g.emission;
+			irradiance[(lh - ly - 1)*lw + lx] = Vec(g.albedo.x > 1e-3 ? std::max(0.0, v.x) / g.albedo.x : 0,
+				g.albedo.y > 1e-3 ? std::max(0.0, v.y) / g.albedo.y : 0, g.albedo.z > 1e-3 ? std::max(0.0, v.z) / g.albedo.z : 0);
+		}
+
+	scheduler.parallelFor(0, h, 4, [&](int begin, int end) {
+		for (int y = begin; y < end; y++)
+			for (int x = 0; x < w; x++) {
+				const int i = (h - y - 1)*w + x;
+				const Upsampler::GBuffer &g = full[i];
+				// position in low-resolution pixel units, then its 4x4 neighbourhood
+				double u = (x + .5) / sx - .5, v = (y + .5) / sy - .5;
+				int x0 = int(floor(u)) - 1, y0 = int(floor(v)) - 1;
+				Vec sum;
+				double total = 0, nearest = 1e30;
+				Vec fallback;
+				for (int ly = std::max(0, y0); ly < std::min(lh, y0 + 4); ly++)
+					for (int lx = std::max(0, x0); lx < std::min(lw, x0 + 4); lx++) {
+						const Upsampler::GBuffer &q = low[(lh - ly - 1)*lw + lx];
+						const Vec &e = irradiance[(lh - ly - 1)*lw + lx];
+						double du = lx - u, dv = ly - v, d2 = du*du + dv*dv;
+						if (d2 < nearest) { nearest = d2; fallback = e; }
+						if (q.id != g.id) continue;
+						double cosine = 1 - std::min(1.0, q.normal.dot(g.normal)), depth = g.depth > 0 ? (q.depth - g.depth) / g.depth : 0;
+						double weight = exp(-0.5 * d2 - cosine * cosine / (2 * upsampler.sigmaNormal * upsampler.sigmaNormal) -
+							depth * depth / (2 * upsampler.sigmaDepth * upsampler.sigmaDepth));
+						sum = sum + e * weight;
+						total += weight;
+					}
+				Vec e = total > 1e-6 ? sum * (1 / total) : fallback;
+				acc.c[i] = clamp(g.emission + g.albedo.mult(e));
+				acc.samps[i] = 1;
+			}
+	});
+	if (!control.quiet)
+		fprintf(stderr, "\nUpsampled %dx%d -> %dx%d: %.2fs for primary hits, %.2fs total\n", lw, lh, w, h, primaryTime,
+			std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
 }
 
+/*
+* Incremental re-rendering after material edits: --state FILE keeps the
+* accumulation buffer, each pixel's material mask and the material colours
+* between runs. A run with --edit NAME R,G,B and an existing state only
+* re-traces the pixels whose paths touched an edited material, from scratch
+* and at the same sample count, and keeps every other pixel as it was.
+*/
+
+struct RenderState {
+	// the state of the last run if it matches this image, else false
+	static bool load(const char *path, Accumulator &acc, int samps) {
+		FILE *f = fopen(path, "rb");
+		if (!f) return false;
+		char magic[8];
+		int header[3], count;
+		bool ok = fread(magic, 8, 1, f) == 1 && !memcmp(magic, "SPTSTAT1", 8) && fread(header, sizeof(header), 1, f) == 1 &&
+			header[0] == acc.w && header[1] == acc.h && header[2] == samps && fread(&count, sizeof(count), 1, f) == 1;
+		for (int k = 0; ok && k < count; k++) {
+			char name[32];
+			double albedo[3];
+			ok = fread(name, sizeof(name), 1, f) == 1 && fread(albedo, sizeof(albedo), 1, f) == 1;
+			name[31] = 0;
+			if (BRDF *brdf = ok ? materialTable.find(name) : 0) brdf->setAlbedo(Vec(albedo[0], albedo[1], albedo[2]));
+		}
+		const size_t n = size_t(acc.w) * acc.h;
+		ok = ok && fread(&acc.c[0], sizeof(Vec), n, f) == n && fread(&acc.samps[0], sizeof(int), n, f) == n &&
+			fread(&acc.materials[0], sizeof(unsigned long long), n, f) == n;
+		fclose(f);
+		return ok;
+	}
+
+	static void save(const char *path, const Accumulator &acc, int samps) {
+		std::string tmp = std::string(path) + ".tmp";
+		FILE *f = fopen(tmp.c_str(), "wb");
+		if (!f) return;
+		int header[3] = { acc.w, acc.h, samps }, count = int(materialTable.entries.size());
+		fwrite("SPTSTAT1", 8, 1, f);
+		fwrite(header, sizeof(header), 1, f);
+		fwrite(&count, sizeof(count), 1, f);
+		for (int k = 0; k < count; k++) {
+			char name[32] = {};
+			strncpy(name, materialTable.entries[k].name, sizeof(name) - 1);
+			Vec a = materialTable.entries[k].brdf->albedo();
+			double albedo[3] = { a.x, a.y, a.z };
+			fwrite(name, sizeof(name), 1, f);
+			fwrite(albedo, sizeof(albedo), 1, f);
+		}
+		const size_t n = size_t(acc.w) * acc.h;
+		fwrite(&acc.c[0], sizeof(Vec), n, f);
+		fwrite(&acc.samps[0], sizeof(int), n, f);
+		fwrite(&acc.materials[0], sizeof(unsigned long long), n, f);
+		fclose(f);
+		rename(tmp.c_str(), path);
+	}
+};
 
 /*
-* Main function (do not modify)
+* Self-test (--selftest): statistical checks that the estimators, and the fast
+* paths built on them, stay unbiased. Samplers are binned against their
+* pdfs (chi-square), BRDFs are integrated against their albedo, the
+* integrators render a furnace with a known answer, and every fast path is
+* compared with the plain estimator on the scene, region by region. The
+* generator is seeded, so a run is reproducible; a test fails at p < 1e-3.
 */
 
+struct SelfTest {
+	// running mean and variance (Welford)
+	struct Moments {
+		void add(double v) { n++; double d = v - mean; mean += d / n; m2 += d * (v - mean); }
+		double meanVariance() const { return n > 1 ? m2 / (n - 1) / n : 0; }
+		double n = 0, mean = 0, m2 = 0;
+	};
 
+	// estimates for a batch of camera rays
+	typedef std::function<void(const Ray *, int, Vec *)> Estimator;
 
-int main(int argc, char *argv[]) {
-	int nworkers = omp_get_num_procs();
-	omp_set_num_threads(nworkers);
-	rng.init(nworkers);
+	// upper tail of the chi-square distribution (Wilson-Hilferty approximation)
+	static double chiSquareTail(double x, int dof) {
+		if (dof < 1) return 1;
+		double k = dof, z = (cbrt(x / k) - (1 - 2 / (9 * k))) / sqrt(2 / (9 * k));
+		return 0.5 * erfc(z / sqrt(2.0));
+	}
 
-	int w = 480, h = 360, samps = argc == 2 ? atoi(argv[1]) / 4 : 1; // # samples
-	Vec cx = Vec(w*.5135 / h), cy = (cx.cross(cam.d)).normalize()*.5135;
-	std::vector<Vec> c(w*h);
+	// two-sided p-value of a mean against its expectation
+	static double zTest(const Moments &m, double expected) {
+		double v = m.meanVariance();
+		if (v <= 0) return std::abs(m.mean - expected) < 1e-9 ? 1 : 0;
+		return erfc(std::abs(m.mean - expected) / sqrt(2 * v));
+	}
 
-#pragma omp parallel for schedule(dynamic, 1)
-	for (int y = 0; y < h; y++) {
-		for (int x = 0; x < w; x++) {
-			const int i = (h - y - 1)*w + x;
+	// Pearson's test of observed against expected counts; bins expected below
+	// 5 are pooled, and counts where nothing is expected fail outright
+	static double chiSquareTest(const std::vector<double> &observed, const std::vector<double> &expected, double &chi2, int &dof) {
+		double pooledObserved = 0, pooledExpected = 0;
+		chi2 = 0;
+		dof = -1;
+		for (size_t k = 0; k < expected.size(); k++) {
+			if (expected[k] < 5) {
+				pooledObserved += observed[k];
+				pooledExpected += expected[k];
+				continue;
+			}
+			chi2 += (observed[k] - expected[k]) * (observed[k] - expected[k]) / expected[k];
+			dof++;
+		}
+		if (pooledExpected > 0) {
+			chi2 += (pooledObserved - pooledExpected) * (pooledObserved - pooledExpected) / pooledExpected;
+			dof++;
+		}
+		else if (pooledObserved > 0) return 0;
+		return chiSquareTail(chi2, dof);
+	}
 
-			for (int sy = 0; sy < 2; ++sy) {
-				for (int sx = 0; sx < 2; ++sx) {
-					Vec r;
-					for (int s = 0; s<samps; s++) {
-						double r1 = 2 * rng(), dx = r1<1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
-						double r2 = 2 * rng(), dy = r2<1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
-						Vec d = cx*(((sx + .5 + dx) / 2 + x) / w - .5) +
-							cy*(((sy + .5 + dy) / 2 + y) / h - .5) + cam.d;
-						r = r + receivedRadiance(Ray(cam.o, d.normalize()), 1, true)*(1. / samps);
+	void report(const char *name, double p, const char *detail) {
+		bool ok = p >= 1e-3;
+		failures += !ok;
+		printf("%s  %-44s p %.4f  %s\n", ok ? "PASS" : "FAIL", name, p, detail);
+		fflush(stdout);
+	}
+
+	// sample(d, pdf) draws unit directions with their solid angle pdf, which
+	// should be distributed as pdf(d). Bins split cos(theta) about the axis
+	// in [cosMin, 1] and phi, plus one bin for everything below cosMin.
+	template <class Sample, class Pdf>
+	void directionTest(const char *name, const Vec &axis, double cosMin, int n, Sample sample, Pdf pdf) {
+		enum { ThetaBins = 16, PhiBins = 32, Sub = 8 };
+		const int outside = ThetaBins * PhiBins;
+		Vec u, v, w;
+		createLocalCoord(axis, u, v, w);
+		std::vector<double> observed(outside + 1, 0), expected(outside + 1, 0);
+		double pdfError = 0;
+		for (int s = 0; s < n; s++) {
+			Vec d;
+			double p;
+			sample(d, p);
+			double c = d.dot(w), phi = atan2(d.dot(v), d.dot(u)) + PI;
+			pdfError = std::max(pdfError, std::abs(p - pdf(d)) / std::max(pdf(d), 1e-12));
+			if (c < cosMin) { observed[outside]++; continue; }
+			int i = std::min(ThetaBins - 1, int((c - cosMin) / (1 - cosMin) * ThetaBins));
+			int j = std::min(PhiBins - 1, int(phi / (2 * PI) * PhiBins));
+			observed[i * PhiBins + j]++;
+		}
+		// midpoint rule in (cos(theta), phi), where the solid angle measure is flat
+		const double dc = (1 - cosMin) / (ThetaBins * Sub), dphi = 2 * PI / (PhiBins * Sub);
+		double inside = 0;
+		for (int i = 0; i < ThetaBins; i++)
+			for (int j = 0; j < PhiBins; j++) {
+				double sum = 0;
+				for (int a = 0; a < Sub; a++)
+					for (int b = 0; b < Sub; b++) {
+						double c = cosMin + (i * Sub + a + .5) * dc, phi = (j * Sub + b + .5) * dphi - PI;
+						double r = sqrt(std::max(0.0, 1 - c * c));
+						sum += pdf(u * (r * cos(phi)) + v * (r * sin(phi)) + w * c) * dc * dphi;
 					}
-					c[i] = c[i] + Vec(clamp(r.x), clamp(r.y), clamp(r.z))*.25;
-				}
+				expected[i * PhiBins + j] = sum * n;
+				inside += sum;
+			}
+		expected[outside] = std::max(0.0, 1 - inside) * n;
+		double chi2;
+		int dof;
+		double p = chiSquareTest(observed, expected, chi2, dof);
+		char detail[128];
+		snprintf(detail, sizeof(detail), "chi2 %.1f  dof %d  pdf error %.1e", chi2, dof, pdfError);
+		// the reported pdf has to match the distribution too (the samplers work in floats)
+		report(name, pdfError < 1e-3 ? p : 0, detail);
+	}
+
+	// integral of eval * cos over the hemisphere by uniform sampling, against the albedo
+	void energyTest(const char *name, const BRDF &brdf, const Vec &o, int n) {
+		const Vec normal(0, 0, 1);
+		Vec u, v, w;
+		createLocalCoord(normal, u, v, w);
+		Moments m;
+		for (int s = 0; s < n; s++) {
+			double c = rng(), r = sqrt(std::max(0.0, 1 - c * c)), phi = 2 * PI * rng();
+			Vec i = u * (r * cos(phi)) + v * (r * sin(phi)) + w * c;
+			Vec f = brdf.eval(normal, o, i) * (c * 2 * PI);
+			m.add(f.x + f.y + f.z);
+		}
+		Vec a = brdf.albedo();
+		char detail[128];
+		snprintf(detail, sizeof(detail), "mean %.4f  albedo %.4f", m.mean, a.x + a.y + a.z);
+		report(name, zTest(m, a.x + a.y + a.z), detail);
+	}
+
+	// A fast path against a reference estimator with the same expectation,
+	// as a paired test: both shade the same camera rays, spread evenly over
+	// regions x regions blocks of the image, and the per region mean
+	// differences are tested against zero (sum of squared z-scores).
+	// Pairing cancels the variance of where the rays land.
+	enum { Regions = 2, Batch = 256 };
+	void compare(const char *name, int w, int h, int n, Estimator reference, Estimator fast) {
+		const Vec cx = Vec(w*.5135 / h), cy = (cx.cross(cam.d)).normalize()*.5135;
+		std::vector<Moments> m(Regions * Regions);
+		Ray rays[Batch];
+		int region[Batch];
+		Vec a[Batch], b[Batch];
+		for (int s = 0; s < n; s += Batch) {
+			for (int k = 0; k < Batch; k++) {
+				int j = (s + k) % (Regions * Regions);
+				int x = std::min(w - 1, int((j % Regions + rng()) * w / Regions)), y = std::min(h - 1, int((j / Regions + rng()) * h / Regions));
+				rays[k] = cameraRay(cx, cy, w, h, x, y, rng() < .5, rng() < .5, 0);
+				region[k] = j;
+				a[k] = b[k] = Vec();
+			}
+			reference(rays, Batch, a);
+			fast(rays, Batch, b);
+			for (int k = 0; k < Batch; k++) {
+				Vec d = b[k] - a[k];
+				m[region[k]].add(d.x + d.y + d.z);
+			}
+		}
+		regionTest(name, m);
+	}
+
+	// Per region mean differences against zero (sum of squared z-scores). The
+	// channels are summed rather than tested apart: they share every path, so
+	// their z-scores are strongly correlated (identical for ambient occlusion)
+	// and counting them as separate degrees of freedom makes the test fail far
+	// more often than its p-value says.
+	void regionTest(const char *name, const std::vector<Moments> &m) {
+		double chi2 = 0, offset = 0;
+		int dof = 0;
+		for (size_t k = 0; k < m.size(); k++) {
+			offset += m[k].mean / m.size();
+			if (m[k].meanVariance() <= 0) continue;
+			chi2 += m[k].mean * m[k].mean / m[k].meanVariance();
+			dof++;
+		}
+		char detail[128];
+		snprintf(detail, sizeof(detail), "chi2 %.1f  dof %d  mean offset %+.4f", chi2, dof, offset);
+		report(name, chiSquareTail(chi2, dof), detail);
+	}
+
+	// scalar estimator over a batch
+	template <class F>
+	static Estimator each(F f) {
+		return [f](const Ray *rays, int n, Vec *out) { for (int k = 0; k < n; k++) out[k] = f(rays[k]); };
+	}
+
+	// directLighting() for a batch, shadow rays traced as packets
+	static void directLightingPackets(const Ray *rays, int n, Vec *out) {
+		DirectBatch batch;
+		for (int k = 0; k < n; k++) batch.add(rays[k], out[k]);
+		batch.flush();
+	}
+
+	// renders samps samples per subpixel into a w x h accumulator
+	typedef std::function<void(Accumulator &, int)> Renderer;
+
+	// An alternative renderer against render() for modes that change where or
+	// how samples are drawn rather than what a ray estimates: both render the
+	// same small image and the per pixel differences are tested region by
+	// region. The images come from independent streams, so only pixels pair up.
+	// Pixels are compared before the display clamp, whose bias shrinks with the
+	// variance and so legitimately differs between samplers.
+	void compareImages(const char *name, int w, int h, int samps, Renderer reference, Renderer fast) {
+		Accumulator a(w, h), b(w, h);
+		reference(a, samps);
+		fast(b, samps);
+		auto unclamped = [](const Accumulator &acc, int i) {
+			Vec v = acc.sub[4 * i] + acc.sub[4 * i + 1] + acc.sub[4 * i + 2] + acc.sub[4 * i + 3];
+			return acc.samps[i] ? v * (1.0 / (4 * acc.samps[i])) : Vec();
+		};
+		std::vector<Moments> m(Regions * Regions);
+		for (int y = 0; y < h; y++)
+			for (int x = 0; x < w; x++) {
+				const int i = (h - y - 1)*w + x;
+				Vec d = unclamped(b, i) - unclamped(a, i);
+				m[(y * Regions / h) * Regions + x * Regions / w].add(d.x + d.y + d.z);
+			}
+		regionTest(name, m);
+	}
+
+	void samplers() {
+		DiffuseBRDF diffuse(Vec(1, 1, 1));
+		const Vec n = Vec(.3, -.5, .8).normalize(), o = Vec(-.2, .6, .7).normalize();
+		directionTest("DiffuseBRDF::sample", n, -1, 1000000,
+			[&](Vec &d, double &p) { diffuse.sample(n, o, d, p); },
+			[&](const Vec &d) { return std::max(0.0, d.dot(n)) / PI; });
+
+		// regularized mirror: uniform in a cone about the mirror direction
+		SpecularBRDF mirror(Vec(1, 1, 1));
+		Regularization::current = 0.2;
+		const double cosMax = cos(Regularization::current);
+		const Vec m = mirror.mirroredDirection(n, o);
+		directionTest("SpecularBRDF::sample (regularized)", m, cosMax, 1000000,
+			[&](Vec &d, double &p) { mirror.sample(n, o, d, p); },
+			[&](const Vec &d) { return d.dot(m) >= cosMax ? 1 / (2 * PI * (1 - cosMax)) : 0.0; });
+
+		// light points as normals on the unit sphere; the area pdf becomes a solid angle one
+		const Sphere &light = spheres[7];
+		double positionError = 0;
+		directionTest("luminaireSample", Vec(0, 1, 0), -1, 1000000,
+			[&](Vec &d, double &p) {
+				Vec y;
+				luminaireSample(light, 0, y, d, p);
+				Vec e = y - (light.center(0) + d * light.rad);
+				positionError = std::max(positionError, sqrt(e.dot(e)) / light.rad);
+				p *= light.rad * light.rad;
+			},
+			[&](const Vec &) { return 1 / (4 * PI); });
+		char detail[64];
+		snprintf(detail, sizeof(detail), "max error %.1e radii", positionError);
+		report("luminaireSample points on the light", positionError < 1e-5 ? 1 : 0, detail);
+
+		// white furnace for the BRDFs themselves
+		for (size_t k = 0; k < materialTable.entries.size(); k++) {
+			const BRDF &brdf = *materialTable.entries[k].brdf;
+			if (brdf.isSpecular()) continue;
+			std::string name = std::string("energy ") + materialTable.entries[k].name;
+			energyTest(name.c_str(), brdf, o, 200000);
+		}
+		// a cone about the normal stays above the horizon
+		energyTest("energy SpecularBRDF (regularized)", mirror, Vec(0, 0, 1), 2000000);
+		Regularization::current = 0;
+	}
+
+	// every fast path against the plain estimator with the same expectation
+	void fastPaths(int w, int h) {
+		const int n = 1 << 16;
+		const bool cache = shadowCache.enabled;
+		const RenderSettings defaults = settings;
+		auto path = each([](const Ray &r) { return receivedRadiance(r, 1, true); });
+		auto direct = each([](const Ray &r) { return directLighting(r); });
+
+		// the reference traces every shadow ray; fast paths are switched on while they run
+		auto cached = [&](Estimator e) {
+			return [=](const Ray *rays, int count, Vec *out) {
+				shadowCache.enabled = true;
+				e(rays, count, out);
+				shadowCache.enabled = false;
+			};
+		};
+		auto split = [&](Estimator e) {
+			return [=](const Ray *rays, int count, Vec *out) {
+				settings.lightSplit = 4;
+				settings.brdfSplit = 2;
+				settings.splitSecondary = true;
+				e(rays, count, out);
+				settings = defaults;
+			};
+		};
+		auto roulette = [&](Estimator e) {
+			return [=](const Ray *rays, int count, Vec *out) {
+				settings.rrDepth = 2;
+				settings.survivalProbability = 0.75f;
+				e(rays, count, out);
+				settings = defaults;
+			};
+		};
+		shadowCache.enabled = false;
+		compare("path: shadow cache", w, h, n, path, cached(path));
+		compare("direct: shadow cache", w, h, n, direct, cached(direct));
+		compare("direct: shadow packets", w, h, n, direct, directLightingPackets);
+		compare("path: light/BRDF splitting", w, h, n, path, split(path));
+		compare("path: early Russian roulette", w, h, n, path, roulette(path));
+		settings = defaults;
+		shadowCache.enabled = cache;
+	}
+
+	// The nearest hit through the sphere BVH against the linear loop, for n
+	// rays from random points in the box in random directions at random
+	// times. Both must find the same sphere at the same distance; a mismatch
+	// is a bug, not noise.
+	void sameHits(const char *name, int n) {
+		int mismatches = 0;
+		for (int k = 0; k < n; k++) {
+			double c = 2 * rng() - 1, r = sqrt(std::max(0.0, 1 - c * c)), phi = 2 * PI * rng();
+			Ray ray(Vec(1 + 98 * rng(), 1 + 80 * rng(), 1 + 168 * rng()), Vec(r * cos(phi), r * sin(phi), c), rng());
+			Hit a, b;
+			sphereBVH.linear = true;
+			intersect(ray, a);
+			sphereBVH.linear = false;
+			intersect(ray, b);
+			if (a.id != b.id || std::abs(a.t - b.t) > 1e-9 * a.t) mismatches++;
+		}
+		char detail[64];
+		snprintf(detail, sizeof(detail), "%d of %d rays differ", mismatches, n);
+		report(name, mismatches ? 0 : 1, detail);
+	}
+
+	// the sphere BVH against the linear loop over the spheres, on the scene and
+	// on the scene plus moving particles, with time segments and with swept
+	// bounds: exact nearest hits, then the path estimate through each
+	void sphereBVHs(int w, int h, bool sweptBounds, int timeSegments) {
+		const int n = 1 << 16;
+		auto path = each([](const Ray &r) { return receivedRadiance(r, 1, true); });
+		auto linear = [&](Estimator e) {
+			return [=](const Ray *rays, int count, Vec *out) {
+				sphereBVH.linear = true;
+				e(rays, count, out);
+				sphereBVH.linear = false;
+			};
+		};
+		std::vector<Sphere> scene = spheres;
+		shadowCache.init(int(rng.engines.size()));
+		sphereBVH.build(false, 1);
+		sphereBVH.linear = false;
+		sameHits("hits: sphere BVH", n);
+		compare("path: sphere BVH", w, h, n, linear(path), path);
+
+		std::mt19937 placement(11);
+		std::uniform_real_distribution<double> unit(0, 1);
+		for (int k = 0; k < 64; k++) {
+			Vec p(10 + 80 * unit(placement), 5 + 70 * unit(placement), 20 + 110 * unit(placement));
+			Vec v(unit(placement) - .5, unit(placement) - .5, unit(placement) - .5);
+			spheres.push_back(Sphere(3, p, Vec(), brightSurf, v.normalize() * (30 * unit(placement))));
+		}
+		sphereBVH.build(false, 4);
+		sameHits("hits: moving spheres, 4 time segments", n);
+		compare("path: moving spheres, 4 time segments", w, h, n, linear(path), path);
+		sphereBVH.build(true, 1);
+		sameHits("hits: moving spheres, swept bounds", n);
+		compare("path: moving spheres, swept bounds", w, h, n, linear(path), path);
+
+		spheres.swap(scene);
+		sphereBVH.build(sweptBounds, timeSegments);
+		shadowCache.init(int(rng.engines.size()));
+	}
+
+	// renderers that split or place samples differently, against render()
+	void renderers() {
+		const int w = 64, h = 48, samps = 8;
+		const RenderSettings defaults = settings;
+		control.quiet = true;
+		settings.sampsPerPass = samps;
+		auto plain = [](Accumulator &acc, int samps) { scheduler.waitAll(render(acc, samps)); };
+		auto blue = [](Accumulator &acc, int samps) {
+			blueNoise.enabled = true;
+			scheduler.waitAll(render(acc, samps));
+			blueNoise.enabled = false;
+		};
+		compareImages("image: sample-parallel", w, h, samps, plain, renderSampleParallel);
+		if (blueNoise.tile.empty()) blueNoise.generate();
+		compareImages("image: blue noise", w, h, samps, plain, blue);
+		settings = defaults;
+		control.quiet = false;
+	}
+
+	// A light sphere (radius s R) inside a concentric diffuse shell (radius R,
+	// albedo a). By symmetry the shell's radiance B is uniform: it is lit by
+	// the light with irradiance pi Le s^2 and by itself over the rest of the
+	// hemisphere, so B = a Le s^2 / (1 - a (1 - s^2)) and one light sample
+	// alone gives a Le s^2. The light stays spheres[7], as the estimators expect.
+	void furnace(bool sweptBounds, int timeSegments) {
+		const double R = 100, s = .3, a = .8, Le = 1;
+		DiffuseBRDF shell(Vec(a, a, a));
+		std::vector<Sphere> scene;
+		std::vector<std::unique_ptr<Mesh>> noMeshes;
+		scene.push_back(Sphere(R, Vec(), Vec(), shell));
+		for (int k = 1; k < 7; k++) scene.push_back(Sphere(1, Vec(10 * R, 0, 10 * R * k), Vec(), blackSurf));   // out of sight
+		scene.push_back(Sphere(s * R, Vec(), Vec(Le, Le, Le), blackSurf));
+		spheres.swap(scene);
+		meshes.swap(noMeshes);
+		sphereBVH.build(false, 1);
+		shadowCache.init(int(rng.engines.size()));     // cached occluders are ids in the old scene
+		const bool cache = shadowCache.enabled;
+		const RenderSettings defaults = settings;
+
+		// rays from between the spheres, heading outwards, so they all see the shell
+		const int n = 1 << 16;
+		std::vector<Ray> rays;
+		DiffuseBRDF outwards(Vec(1, 1, 1));
+		for (int k = 0; k < n; k++) {
+			double z = 2 * rng() - 1, r = sqrt(1 - z * z), phi = 2 * PI * rng(), pdf;
+			Vec normal(r * cos(phi), r * sin(phi), z), d;
+			outwards.sample(normal, normal, d, pdf);
+			rays.push_back(Ray(normal * (R * (s + (1 - s) * .9 * rng())), d));
+		}
+		const double B = a * Le * s * s / (1 - a * (1 - s * s)), direct = a * Le * s * s;
+		auto furnaceTest = [&](const char *name, double expected, Estimator estimator) {
+			Moments m;
+			std::vector<Vec> values(Batch);
+			for (int k = 0; k < n; k += Batch) {
+				estimator(&rays[k], Batch, &values[0]);
+				for (int j = 0; j < Batch; j++) m.add((values[j].x + values[j].y + values[j].z) / 3);
 			}
+			char detail[128];
+			snprintf(detail, sizeof(detail), "mean %.5f  expected %.5f", m.mean, expected);
+			report(name, zTest(m, expected), detail);
+		};
+		shadowCache.enabled = false;
+		furnaceTest("furnace: path", B, each([](const Ray &r) { return receivedRadiance(r, 1, true); }));
+		furnaceTest("furnace: direct", direct, each([](const Ray &r) { return directLighting(r); }));
+		shadowCache.enabled = true;
+		furnaceTest("furnace: path, shadow cache", B, each([](const Ray &r) { return receivedRadiance(r, 1, true); }));
+		furnaceTest("furnace: direct, shadow packets", direct, directLightingPackets);
+		settings.rrDepth = 2;
+		settings.survivalProbability = 0.75f;
+		furnaceTest("furnace: path, early Russian roulette", B, each([](const Ray &r) { return receivedRadiance(r, 1, true); }));
+		settings = defaults;
+		settings.lightSplit = 4;
+		settings.brdfSplit = 2;
+		furnaceTest("furnace: path, light/BRDF splitting", B, each([](const Ray &r) { return receivedRadiance(r, 1, true); }));
+		settings = defaults;
+		shadowCache.enabled = cache;
+
+		spheres.swap(scene);
+		meshes.swap(noMeshes);
+		sphereBVH.build(sweptBounds, timeSegments);
+		shadowCache.init(int(rng.engines.size()));
+	}
+
+	// the number of failed tests
+	static int run(int w, int h, bool sweptBounds, int timeSegments) {
+		SelfTest t;
+		blueNoise.enabled = false;      // camera samples here are independent draws
+		t.samplers();
+		t.fastPaths(w, h);
+		t.sphereBVHs(w, h, sweptBounds, timeSegments);
+		t.renderers();
+		t.furnace(sweptBounds, timeSegments);
+		printf("%d failed\n", t.failures);
+		return t.failures;
+	}
+
+	int failures = 0;
+};
+
+
+int main(int argc, char *argv[]) {
+	int hwThreads = std::max(1u, std::thread::hardware_concurrency());
+	int w = 480, h = 360, samps = 1; // # samples (per subpixel)
+	const char *socketPath = 0, *profilePath = "simplept.profile";
+	bool calibrating = false, selftest = false, preview = false, sampleParallel = false, benchSplat = false, pathSpaceFiltering = false;
+	bool neuralCache = false, verbose = false, lightTracing = false;
+	int buckets = 0, frames = 0;
+	const char *statePath = 0;
+	std::vector<std::pair<BRDF *, Vec>> edits;
+	Vec cameraMove(10, 0, 0);
+	std::vector<std::pair<const char *, bool>> meshPaths;   // path, subdivision surface?
+	double meshScale = 1, splitBudget = 0.3;
+	int subdivLevel = 8, quantizeBits = 0;
+	double displaceAmplitude = 0.5, displaceFrequency = 1, tessCacheMB = 64;
+	Vec meshOffset;
+	bool spatialSplits = true, sweptBounds = false;
+	int particles = 0, timeSegments = 0;
+	double particleSpeed = 10;
+	for (int a = 1; a < argc; a++)
+		if (!strcmp(argv[a], "--profile") && a + 1 < argc) profilePath = argv[++a];
+	settings.load(profilePath);
+	for (int a = 1; a < argc; a++) {
+		if (!strcmp(argv[a], "--socket") && a + 1 < argc) socketPath = argv[++a];
+		else if (!strcmp(argv[a], "--budget") && a + 1 < argc) control.budget = atof(argv[++a]);
+		else if (!strcmp(argv[a], "--spp-per-pass") && a + 1 < argc) settings.sampsPerPass = std::max(1, atoi(argv[++a]) / 4);
+		else if (!strcmp(argv[a], "--tile") && a + 1 < argc) settings.tile = std::max(1, atoi(argv[++a]));
+		else if (!strcmp(argv[a], "--threads") && a + 1 < argc) settings.threads = std::max(1, atoi(argv[++a]));
+		else if (!strcmp(argv[a], "--profile") && a + 1 < argc) ++a;
+		else if (!strcmp(argv[a], "--calibrate")) calibrating = true;
+		else if (!strcmp(argv[a], "--selftest")) selftest = true;
+		else if (!strcmp(argv[a], "--verbose")) verbose = true;
+		else if (!strcmp(argv[a], "--preview")) preview = true;
+		else if (!strcmp(argv[a], "--sample-parallel")) sampleParallel = true;
+		else if (!strcmp(argv[a], "--psf")) pathSpaceFiltering = true;
+		else if (!strcmp(argv[a], "--nrc")) neuralCache = true;
+		else if (!strcmp(argv[a], "--nrc-depth") && a + 1 < argc) radianceCache.terminateDepth = std::max(1, atoi(argv[++a]));
+		else if (!strcmp(argv[a], "--nrc-train-every") && a + 1 < argc) radianceCache.trainEvery = std::max(1, atoi(argv[++a]));
+		else if (!strcmp(argv[a], "--nrc-steps") && a + 1 < argc) radianceCache.maxSteps = std::max(0, atoi(argv[++a]));
+		else if (!strcmp(argv[a], "--frames") && a + 1 < argc) frames = std::max(0, atoi(argv[++a]));
+		else if (!strcmp(argv[a], "--camera-move") && a + 1 < argc) sscanf(argv[++a], "%lf,%lf,%lf", &cameraMove.x, &cameraMove.y, &cameraMove.z);
+		else if (!strcmp(argv[a], "--temporal")) temporal.enabled = true;
+		else if (!strcmp(argv[a], "--state") && a + 1 < argc) statePath = argv[++a];
+		else if (!strcmp(argv[a], "--edit") && a + 2 < argc) {
+			BRDF *brdf = materialTable.find(argv[++a]);
+			Vec v;
+			sscanf(argv[++a], "%lf,%lf,%lf", &v.x, &v.y, &v.z);
+			if (brdf) edits.push_back(std::make_pair(brdf, v));
+			else fprintf(stderr, "Unknown material %s\n", argv[a - 1]);
+		}
+		else if (!strcmp(argv[a], "--upsample") && a + 1 < argc) upsampler.factor = std::max(1, atoi(argv[++a]));
+		else if (!strcmp(argv[a], "--history") && a + 1 < argc) temporal.maxFrames = std::max(1.0, atof(argv[++a]));
+		else if (!strcmp(argv[a], "--psf-radius") && a + 1 < argc) pathSpaceFilter.radius = std::max(1e-3, atof(argv[++a]));
+		else if (!strcmp(argv[a], "--psf-normal") && a + 1 < argc) pathSpaceFilter.minCosine = atof(argv[++a]);
+		else if (!strcmp(argv[a], "--bench-splat")) benchSplat = true;
+		else if (!strcmp(argv[a], "--light-tracing")) lightTracing = true;
+		else if (!strcmp(argv[a], "--blue-noise")) blueNoise.enabled = true;
+		else if (!strcmp(argv[a], "--split-light") && a + 1 < argc) settings.lightSplit = std::max(1, atoi(argv[++a]));
+		else if (!strcmp(argv[a], "--split-brdf") && a + 1 < argc) settings.brdfSplit = std::max(1, atoi(argv[++a]));
+		else if (!strcmp(argv[a], "--split-secondary")) settings.splitSecondary = true;
+		else if (!strcmp(argv[a], "--regularize")) regularization.enabled = true;
+		else if (!strcmp(argv[a], "--mesh") && a + 1 < argc) meshPaths.push_back(std::make_pair(argv[++a], false));
+		else if (!strcmp(argv[a], "--mesh-scale") && a + 1 < argc) meshScale = atof(argv[++a]);
+		else if (!strcmp(argv[a], "--mesh-offset") && a + 1 < argc) sscanf(argv[++a], "%lf,%lf,%lf", &meshOffset.x, &meshOffset.y, &meshOffset.z);
+		else if (!strcmp(argv[a], "--no-spatial-splits")) spatialSplits = false;
+		else if (!strcmp(argv[a], "--shadow-cache")) shadowCache.enabled = true;
+		else if (!strcmp(argv[a], "--no-shadow-packets")) shadowPackets.enabled = false;
+		else if (!strcmp(argv[a], "--split-budget") && a + 1 < argc) splitBudget = atof(argv[++a]);
+		else if (!strcmp(argv[a], "--subdiv") && a + 1 < argc) meshPaths.push_back(std::make_pair(argv[++a], true));
+		else if (!strcmp(argv[a], "--subdiv-level") && a + 1 < argc) subdivLevel = std::min(32, std::max(1, atoi(argv[++a])));
+		else if (!strcmp(argv[a], "--displace") && a + 1 < argc) displaceAmplitude = atof(argv[++a]);
+		else if (!strcmp(argv[a], "--displace-freq") && a + 1 < argc) displaceFrequency = atof(argv[++a]);
+		else if (!strcmp(argv[a], "--tess-cache") && a + 1 < argc) tessCacheMB = atof(argv[++a]);
+		else if (!strcmp(argv[a], "--quantize") && a + 1 < argc) { int bits = atoi(argv[++a]); quantizeBits = bits > 16 ? 21 : bits > 0 ? 16 : 0; }
+		else if (!strcmp(argv[a], "--move") && a + 2 < argc) {
+			int id = atoi(argv[++a]);
+			Vec v;
+			sscanf(argv[++a], "%lf,%lf,%lf", &v.x, &v.y, &v.z);
+			if (id >= 0 && id < int(spheres.size())) spheres[id].v = v;
+		}
+		else if (!strcmp(argv[a], "--particles") && a + 1 < argc) particles = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "--particle-speed") && a + 1 < argc) particleSpeed = atof(argv[++a]);
+		else if (!strcmp(argv[a], "--swept-bounds")) sweptBounds = true;
+		else if (!strcmp(argv[a], "--time-segments") && a + 1 < argc) timeSegments = std::max(0, atoi(argv[++a]));
+		else if (!strcmp(argv[a], "--integrator") && a + 1 < argc) {
+			if (!integrator.parse(argv[++a])) fprintf(stderr, "Unknown integrator %s, using path\n", argv[a]);
+		}
+		else if (!strcmp(argv[a], "--ao-radius") && a + 1 < argc) integrator.aoRadius = atof(argv[++a]);
+		else if (!strcmp(argv[a], "--spectral")) spectral.enabled = true;
+		else if (!strcmp(argv[a], "--mom") && a + 1 < argc) buckets = std::min(32, std::max(0, atoi(argv[++a])));
+		else if (!strcmp(argv[a], "--regularize-angle") && a + 1 < argc) regularization.initialAngle = atof(argv[++a]);
+		else if (!strcmp(argv[a], "--size") && a + 1 < argc) sscanf(argv[++a], "%dx%d", &w, &h);
+		else if (argv[a][0] && strspn(argv[a], "0123456789") == strlen(argv[a])) samps = atoi(argv[a]) / 4;
+		else {
+			// a mistyped flag or one missing its value would otherwise read as 0 spp
+			fprintf(stderr, "Unknown option or missing value: %s\nUsage: simplept [spp] [options], options as listed in simplept.cpp\n", argv[a]);
+			return 1;
+		}
+	}
+	// more buckets than samples per subpixel leave each bucket a sample or two,
+	// and the median of such means is biased low for skewed radiance; the
+	// median of one or two bucket means is just their unclamped mean
+	if (buckets && std::min(buckets, samps) < 3) {
+		fprintf(stderr, "--mom %d with %d samples per subpixel leaves fewer than 3 buckets; using the clamped mean\n", buckets, samps);
+		buckets = 0;
+	}
+	else if (buckets > samps) {
+		fprintf(stderr, "--mom %d exceeds the %d samples per subpixel; using %d buckets\n", buckets, samps, samps);
+		buckets = samps;
+	}
+	startWorkers(settings.threads ? settings.threads : hwThreads);
+	// small moving diffuse spheres filling the box, placed the same way every run
+	std::mt19937 placement(7);
+	std::uniform_real_distribution<double> unit(0, 1);
+	for (int k = 0; k < particles; k++) {
+		Vec p(10 + 80 * unit(placement), 5 + 70 * unit(placement), 20 + 110 * unit(placement));
+		Vec v(unit(placement) - .5, unit(placement) - .5, unit(placement) - .5);
+		spheres.push_back(Sphere(1.5, p, Vec(), brightSurf, v.normalize() * (particleSpeed * unit(placement))));
+	}
+	sphereBVH.build(sweptBounds, timeSegments);
+	for (size_t m = 0; m < meshPaths.size(); m++) {
+		std::unique_ptr<Mesh> mesh;
+		if (meshPaths[m].second) mesh.reset(new SubdivisionMesh(otherWall, subdivLevel, displaceAmplitude,
+			displaceFrequency, size_t(tessCacheMB * 1048576)));
+		else mesh.reset(new TriangleMesh(otherWall, quantizeBits));
+		if (!mesh->load(meshPaths[m].first, meshScale, meshOffset)) {
+			fprintf(stderr, "Cannot load mesh %s\n", meshPaths[m].first);
+			scheduler.shutdown();
+			return 1;
+		}
+		mesh->prepare(spatialSplits, splitBudget);
+		meshes.push_back(std::move(mesh));
+	}
+	if (calibrating) {
+		calibrate(profilePath, hwThreads);
+		scheduler.shutdown();
+		return 0;
+	}
+	if (selftest) {
+		int failures = SelfTest::run(w, h, sweptBounds, timeSegments);
+		scheduler.shutdown();
+		return failures ? 1 : 0;
+	}
+	// a single pass reproduces the original estimator exactly; budgets and
+	// remote control want finer passes so that stopping early loses little
+	if (!settings.sampsPerPass) settings.sampsPerPass = (socketPath || control.budget > 0) ? 1 : std::max(samps, 1);
+	if (blueNoise.enabled) blueNoise.generate();
+	if (spectral.enabled) spectral.init();
+	if (benchSplat) {
+		benchmarkSplatting(w, h, 20000000LL);
+		scheduler.shutdown();
+		return 0;
+	}
+	if (socketPath && !metricsServer.start(socketPath))
+		fprintf(stderr, "Cannot open metrics socket %s\n", socketPath);
+
+	for (size_t k = 0; k < edits.size(); k++) edits[k].first->setAlbedo(edits[k].second);
+	// (the state file keeps resolved pixels, not median-of-means buckets)
+	Accumulator acc(w, h, false, sampleParallel || pathSpaceFiltering || neuralCache || lightTracing || upsampler.factor > 1 || statePath ? 0 : buckets);
+	if (frames) renderAnimation(w, h, samps, frames, cameraMove);
+	else if (upsampler.factor > 1) {
+		renderUpsampled(acc, samps);
+		writeImage("image.ppm", acc);
+	}
+	else if (preview) renderPreview(acc, samps, "image.ppm");
+	else if (neuralCache) {
+		renderNeuralCached(acc, samps);
+		writeImage("image.ppm", acc);
+	}
+	else if (pathSpaceFiltering) {
+		renderPathSpaceFiltered(acc, samps);
+		writeImage("image.ppm", acc);
+	}
+	else if (lightTracing) {
+		renderLightTraced(acc, samps);
+		writeImage("image.ppm", acc);
+	}
+	else if (sampleParallel) {
+		renderSampleParallel(acc, samps);
+		writeImage("image.ppm", acc);
+	}
+	else if (statePath) {
+		acc.materials.assign(w * h, 0);
+		MaterialTable::tracking = true;
+		// the state brings back the colours of earlier edits; this run's go on top
+		bool incremental = RenderState::load(statePath, acc, samps);
+		std::vector<char> affected(w * h, 0);
+		unsigned long long edited = 0;
+		for (size_t k = 0; k < edits.size(); k++) {
+			// only a colour that differs from the stored one invalidates pixels
+			Vec stored = edits[k].first->albedo(), v = edits[k].second;
+			if (stored.x != v.x || stored.y != v.y || stored.z != v.z) edited |= 1ull << edits[k].first->material;
+			edits[k].first->setAlbedo(v);
 		}
-#pragma omp critical
-		fprintf(stderr, "\rRendering (%d spp) %6.2f%%", samps * 4, 100.*y / (h - 1));
+		int count = 0;
+		for (int i = 0; i < w * h; i++)
+			if (!incremental || (acc.materials[i] & edited)) {
+				affected[i] = 1;
+				acc.c[i] = Vec();
+				acc.samps[i] = 0;
+				for (int k = 0; k < 4; k++) acc.sub[4 * i + k] = Vec();
+				acc.materials[i] = 0;
+				count++;
+			}
+		renderAndWrite(acc, samps, "image.ppm", PixelSubset(affected, w, h));
+		if (!control.halted()) RenderState::save(statePath, acc, samps);
+		fprintf(stderr, "\n%s: %d of %d pixels traced (%.1f%%)", incremental ? "Incremental render" : "Full render",
+			count, w * h, 100.0 * count / (w * h));
 	}
+	else renderAndWrite(acc, samps, "image.ppm");
 	fprintf(stderr, "\n");
 
-	// Write resulting image to a PPM file
-	FILE *f = fopen("image.ppm", "w");
-	fprintf(f, "P3\n%d %d\n%d\n", w, h, 255);
-	for (int i = 0; i<w*h; i++)
-		fprintf(f, "%d %d %d ", toInt(c[i].x), toInt(c[i].y), toInt(c[i].z));
-	fclose(f);
+	for (size_t m = 0; m < meshes.size(); m++) meshes[m]->report();
+	if (verbose) shadowCache.report();
+	if (verbose) shadowPackets.report();
+
+	control.finished = true;
+	metricsServer.stop();
+	scheduler.shutdown();
 
 	return 0;
 }